@@ -0,0 +1,92 @@
+/*
+ OFX EXR plugins OpenEXR thread pool.
+ Sets the number of worker threads used by OpenEXR to (de)compress files.
+ 
+ Copyright (C) 2014 INRIA
+ 
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+ 
+ Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 
+ Redistributions in binary form must reproduce the above copyright notice, this
+ list of conditions and the following disclaimer in the documentation and/or
+ other materials provided with the distribution.
+ 
+ Neither the name of the {organization} nor the names of its
+ contributors may be used to endorse or promote products derived from
+ this software without specific prior written permission.
+ 
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ 
+ INRIA
+ Domaine de Voluceau
+ Rocquencourt - B.P. 105
+ 78153 Le Chesnay Cedex - France
+ 
+ */
+
+#ifndef __Io__EXRThreadCount__
+#define __Io__EXRThreadCount__
+
+#include <cstdlib>
+#include <ImfThreading.h>
+#include <ofxsMultiThread.h>
+
+// Number of threads used by OpenEXR to compress and decompress line blocks and tiles.
+// The thread pool is global and shared by all the readers and writers: a thread calling
+// readPixels() or writePixels() waits for the pool to finish, so even when the host renders
+// many frames in parallel, the number of busy threads stays close to the number of CPUs.
+// 0 disables the thread pool, and OpenEXR then works in the calling thread.
+// If it is not set, the pool is sized once, by the first plugin loaded, and only if no thread count was set in the
+// process (e.g. by the host). A thread count set afterwards, including 0, is never overridden.
+#define kEXRThreadCountEnv "OFX_IO_EXR_THREADS"
+
+namespace Exr {
+
+    /// Set the size of the OpenEXR thread pool from the environment, or to the number of CPUs if the pool is disabled
+    /// and was not configured by a plugin yet.
+    /// The thread count is process-wide: this is called from the load action of the plugins, which the host runs
+    /// before creating any instance.
+    inline void
+    setGlobalThreadCount()
+    {
+        // shared by the readers and writers of the plugin binary
+        static bool configured = false;
+        
+        int count = -1;
+        const char* value = std::getenv(kEXRThreadCountEnv);
+        if (value && *value) {
+            char* end = NULL;
+            long l = std::strtol(value, &end, 10);
+            if (*end == '\0' && l >= 0) {
+                count = (int)l;
+            }
+        }
+        if (count < 0) {
+            // keep the thread count set by the host, if any, or after the pool was configured by the first plugin
+            if (configured || Imf::globalThreadCount() != 0) {
+                configured = true;
+                return;
+            }
+            count = (int)OFX::MultiThread::getNumCPUs();
+        }
+        configured = true;
+        if (Imf::globalThreadCount() != count) {
+            Imf::setGlobalThreadCount(count);
+        }
+    }
+
+}
+
+#endif /* defined(__Io__EXRThreadCount__) */
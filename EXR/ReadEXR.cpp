@@ -39,6 +39,14 @@
 #include "ReadEXR.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
 #ifdef DEBUG
 #include <iostream>
 #endif
@@ -50,16 +58,27 @@
 #include <ImfStdIO.h>
 #endif
 
+#include <OpenEXRConfig.h>
 #include <ImfPixelType.h>
 #include <ImfChannelList.h>
-#include <ImfInputFile.h>
+#include <ImfMultiPartInputFile.h>
+#include <ImfInputPart.h>
+#include <ImfTiledInputPart.h>
+#include <ImfPartType.h>
+#include <ImfHeader.h>
+#include <ImfPreviewImage.h>
+#include <half.h>
 
-#ifdef OFX_IO_MT_EXR
-#include <ofxsMultiThread.h>
+#if defined(__F16C__) && defined(__AVX__)
+#include <immintrin.h>
 #endif
 
+#include <ofxsMultiThread.h>
+
 
 #include "GenericReader.h"
+#include "EXRThreadCount.h"
+#include "IOUtility.h"
 
 
 #define kPluginName "ReadEXR"
@@ -69,16 +88,54 @@
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
 #define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
 
+// number of scan lines decoded at once when the render window does not cover the whole width of the data window
+#define kReadEXRScanLinesPerChunk 64
+
+// name of the channels inserted in the frame buffer to fill missing channels
+#define kReadEXRFillChannelPrefix "__ofx_fill_"
+
+// number of opened Imf::InputFile kept per file once the renders using them are finished
+#define kReadEXRMaxIdleHandlesPerFile 4
+
+// number of independently locked parts of the file manager
+#define kReadEXRFileManagerShards 16
+
+#if OPENEXR_VERSION_MAJOR > 2 || (OPENEXR_VERSION_MAJOR == 2 && OPENEXR_VERSION_MINOR >= 2)
+#define OFX_IO_EXR_HAS_DWA // DWAA and DWAB compressions
+#endif
+
+// maximum number of files kept open by the file manager (can be overridden by the environment)
+#define kReadEXRMaxOpenFilesEnv "OFX_IO_EXR_MAX_OPEN_FILES"
+#define kReadEXRMaxOpenFilesDefault 64
+
+// maximum memory used by the line buffers of the files kept open, in MB (can be overridden by the environment)
+#define kReadEXRCacheSizeEnv "OFX_IO_EXR_CACHE_SIZE_MB"
+#define kReadEXRCacheSizeDefault 512
+
 
 #ifndef OPENEXR_IMF_NAMESPACE
 #define OPENEXR_IMF_NAMESPACE Imf
 #endif
 namespace Imf_ = OPENEXR_IMF_NAMESPACE;
 
+#define kParamLayer "layer"
+#define kParamLayerLabel "Layer"
+#define kParamLayerHint \
+"Name of the layer to read: the channels <layer>.R, <layer>.G, <layer>.B and <layer>.A are read as red, green, blue and alpha. " \
+"In multi-part files, a part whose channels have no layer prefix is read by giving the part name. " \
+"Only the channels of this layer are decoded. " \
+"If empty, the channels without a layer prefix are read (or the first layer, if there are none)."
+
+#define kParamUsePreview "usePreview"
+#define kParamUsePreviewLabel "Use Preview"
+#define kParamUsePreviewHint \
+"When rendering at a small scale (e.g. thumbnails), use the 8-bit preview image stored in the file, if it is large enough, " \
+"instead of decoding the pixels. Only used for the channels without a layer prefix."
+
 #define kSupportsRGBA true
 #define kSupportsRGB false
 #define kSupportsAlpha false
-#define kSupportsTiles false
+#define kSupportsTiles true
 
 class ReadEXRPlugin : public GenericReaderPlugin
 {
@@ -96,9 +153,20 @@ private:
 
     virtual void decode(const std::string& filename, OfxTime time, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int rowBytes) OVERRIDE FINAL;
 
+    virtual unsigned int getFileMipmapLevel(const std::string& filename, OfxTime time, unsigned int level) OVERRIDE FINAL;
+
+    virtual void decodeMipmapLevel(const std::string& filename, OfxTime time, unsigned int level, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int rowBytes) OVERRIDE FINAL;
+
     virtual bool getFrameBounds(const std::string& /*filename*/,OfxTime time, OfxRectI *bounds, double *par, std::string *error) OVERRIDE FINAL;
     
     virtual void onInputFileChanged(const std::string& newFile, OFX::PreMultiplicationEnum *premult, OFX::PixelComponentEnum *components) OVERRIDE FINAL;
+
+    virtual void clearAnyCache() OVERRIDE FINAL;
+
+    std::string getLayerName();
+
+    OFX::StringParam* _layer;
+    OFX::BooleanParam* _usePreview;
 };
 
 namespace Exr {
@@ -281,75 +349,200 @@ namespace Exr {
         }
     };
     
-    struct File {
-        
-        File(const std::string& filename);
-        
+#ifdef _WIN32
+    inline std::wstring s2ws(const std::string& s)
+    {
+        int len;
+        int slength = (int)s.length() + 1;
+        len = MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, 0, 0);
+        wchar_t* buf = new wchar_t[len];
+        MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, buf, len);
+        std::wstring r(buf);
+        delete[] buf;
+        return r;
+    }
+#endif
+
+    // An opened Imf::MultiPartInputFile (which also reads single-part files). Each render call checks
+    // out its own handle, so that several threads can decode the same file at the same time.
+    struct InputHandle {
         
-        ~File();
+        InputHandle(const std::string& filename);
         
-        Imf::InputFile* inputfile;
+        ~InputHandle();
         
-        typedef std::map<Channel, std::string> ChannelsMap;
-        ChannelsMap channel_map;
-        int dataOffset;
-        std::vector<std::string> views;
-        OfxRectI displayWindow;
-        OfxRectI dataWindow;
+        Imf_::MultiPartInputFile* inputfile;
 #ifdef _WIN32
         std::ifstream* inputStr;
-        Imf::StdIFStream* inputStdStream;
-#endif
-#ifdef OFX_IO_MT_EXR
-        OFX::MultiThread::Mutex lock;
-#endif
-#ifdef _WIN32
-        inline std::wstring s2ws(const std::string& s)
-        {
-            int len;
-            int slength = (int)s.length() + 1;
-            len = MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, 0, 0);
-            wchar_t* buf = new wchar_t[len];
-            MultiByteToWideChar(CP_ACP, 0, s.c_str(), slength, buf, len);
-            std::wstring r(buf);
-            delete[] buf;
-            return r;
-        }
+        Imf_::StdIFStream* inputStdStream;
 #endif
     };
     
-    File::File(const std::string& filename)
+    InputHandle::InputHandle(const std::string& filename)
     : inputfile(0)
-    , channel_map()
-    , dataOffset(0)
-    , views()
-    , displayWindow()
-    , dataWindow()
 #ifdef _WIN32
     , inputStr(0)
     , inputStdStream(0)
-#endif
-#ifdef OFX_IO_MT_EXR
-    , lock()
 #endif
     {
-        
-        try{
+        try {
 #ifdef _WIN32
             inputStr = new std::ifstream(s2ws(filename),std::ios_base::binary);
             inputStdStream = new Imf_::StdIFStream(*inputStr,filename.c_str());
-            inputfile = new Imf_::InputFile(*inputStdStream);
+            inputfile = new Imf_::MultiPartInputFile(*inputStdStream);
 #else
-            
-            inputfile = new Imf_::InputFile(filename.c_str());
+            inputfile = new Imf_::MultiPartInputFile(filename.c_str());
+#endif
+        } catch (...) {
+#ifdef _WIN32
+            delete inputStdStream;
+            delete inputStr;
 #endif
+            throw;
+        }
+    }
+    
+    InputHandle::~InputHandle() {
+        delete inputfile;
+#ifdef _WIN32
+        delete inputStdStream;
+        delete inputStr;
+#endif
+    }
+    
+    struct File {
+        
+        File(const std::string& filename);
+        
+        
+        ~File();
+        
+        typedef std::map<Channel, std::string> ChannelsMap;
+        
+        // A part of the file which can be decoded (deep parts are ignored).
+        struct Part {
+            int index; ///< part number in the file
+            Imf_::Header header;
+            int dataOffset;
+            OfxRectI displayWindow;
+            OfxRectI dataWindow;
+            bool tiled; ///< true if the part must be read with Imf::TiledInputPart
+            int numLevels; ///< number of mipmap levels (1 if the part is not mipmapped)
+        };
+        
+        // A set of channels named <layer>.R, <layer>.G, <layer>.B, <layer>.A in a part.
+        // The channels of the other layers and parts are never decoded.
+        struct Layer {
+            std::string name; ///< empty for the channels without a layer prefix in single-part files
+            int part; ///< index in parts
+            ChannelsMap channel_map; ///< full EXR channel names
+        };
+        
+        /// Returns the layer with the given name. If name is empty, the default layer is returned.
+        /// Returns NULL if there is no such layer.
+        const Layer* findLayer(const std::string& name) const;
         
+        /// Returns an input handle which is not used by any other thread, opening a new one if necessary.
+        /// It must be given back with release().
+        InputHandle* acquire();
+        
+        /// Gives back a handle obtained from acquire().
+        void release(InputHandle* handle);
+        
+        /// Approximate memory used by the opened handles, in bytes.
+        size_t memoryCost();
+        
+        std::string filename;
+        std::vector<Part> parts;
+        std::vector<Layer> layers;
+        std::vector<std::string> views;
+        
+        int refCount; ///< number of FileReference using this file, protected by the FileManager
+        bool evicted; ///< true if the FileManager dropped this file, it is deleted when refCount drops to 0
+        
+    private:
+        std::list<InputHandle*> _freeHandles;
+        int _openHandles; ///< number of handles opened, including the ones in use
+        size_t _handleMemoryCost; ///< estimated size of the line buffers of one handle
+        OFX::MultiThread::Mutex _handlesLock; // protects _freeHandles and _openHandles
+    };
+    
+    // number of scan lines in a compressed block
+    static int linesInBuffer(Imf_::Compression compression)
+    {
+        switch (compression) {
+            case Imf_::NO_COMPRESSION:
+            case Imf_::RLE_COMPRESSION:
+            case Imf_::ZIPS_COMPRESSION:
+                return 1;
+            case Imf_::ZIP_COMPRESSION:
+            case Imf_::PXR24_COMPRESSION:
+                return 16;
+#ifdef OFX_IO_EXR_HAS_DWA
+            case Imf_::DWAB_COMPRESSION:
+                return 256;
+#endif
+            default:
+                return 32;
+        }
+    }
+    
+    File::File(const std::string& filename_)
+    : filename(filename_)
+    , parts()
+    , layers()
+    , views()
+    , refCount(0)
+    , evicted(false)
+    , _freeHandles()
+    , _openHandles(0)
+    , _handleMemoryCost(0)
+    , _handlesLock()
+    {
+        
+        // the first handle is used to read the headers, and is then kept in the pool.
+        // It is only given to the pool once the headers are read, so that it is closed if they are invalid.
+        std::auto_ptr<InputHandle> handle(new InputHandle(filename));
+        Imf_::MultiPartInputFile& inputfile = *handle->inputfile;
+        const bool multiPart = inputfile.parts() > 1;
+        
+        for (int p = 0; p < inputfile.parts(); ++p) {
+            const Imf_::Header& header = inputfile.header(p);
+            if (header.hasType() && (header.type() == Imf_::DEEPSCANLINE || header.type() == Imf_::DEEPTILE)) {
+#             ifdef DEBUG
+                std::cout << "Cannot decode deep part " << p << std::endl;
+#             endif
+                continue;
+            }
+            
+            Part part;
+            part.index = p;
+            part.header = header;
+            part.tiled = header.hasTileDescription();
+            part.numLevels = 1;
+            if (part.tiled) {
+                Imf_::TiledInputPart tiledPart(inputfile, p);
+                switch (header.tileDescription().mode) {
+                    case Imf_::MIPMAP_LEVELS:
+                        part.numLevels = tiledPart.numLevels();
+                        break;
+                    case Imf_::RIPMAP_LEVELS:
+                        // only the levels downscaled by the same amount in both directions are used
+                        part.numLevels = std::min(tiledPart.numXLevels(), tiledPart.numYLevels());
+                        break;
+                    default:
+                        break;
+                }
+            }
             
-            // convert exr channels to our channels
-            const Imf_::ChannelList& imfchannels = inputfile->header().channels();
+            // convert exr channels to our channels, grouped by layer
+            const Imf_::ChannelList& imfchannels = header.channels();
+            size_t pixelBytes = 0;
             
             for (Imf_::ChannelList::ConstIterator chan = imfchannels.begin(); chan != imfchannels.end(); ++chan) {
                 
+                pixelBytes += (chan.channel().type == Imf_::HALF) ? 2 : 4;
+                
                 std::string chanName(chan.name());
                 
                 ///empty channel, discard it
@@ -362,8 +555,29 @@ namespace Exr {
                 
                 ///if we successfully extracted the channels
                 if (exrExctractor.isValid()) {
-                    ///register the extracted channel
-                    channel_map.insert(std::make_pair(exrExctractor._mappedChannel,exrExctractor._chan));
+                    // the layer is everything before the last '.', or the part name in multi-part files
+                    std::string layerName;
+                    std::size_t dot = chanName.rfind('.');
+                    if (dot != std::string::npos) {
+                        layerName = chanName.substr(0, dot);
+                    } else if (multiPart && header.hasName()) {
+                        layerName = header.name();
+                    }
+                    std::vector<Layer>::iterator layer = layers.begin();
+                    while (layer != layers.end() && layer->name != layerName) {
+                        ++layer;
+                    }
+                    if (layer == layers.end()) {
+                        Layer l;
+                        l.name = layerName;
+                        l.part = (int)parts.size();
+                        layers.push_back(l);
+                        layer = layers.end() - 1;
+                    }
+                    if (layer->part == (int)parts.size()) {
+                        ///register the extracted channel
+                        layer->channel_map.insert(std::make_pair(exrExctractor._mappedChannel,chanName));
+                    }
                 } else {
 #                 ifdef DEBUG
                     std::cout << "Cannot decode channel " << chan.name() << std::endl;
@@ -372,28 +586,39 @@ namespace Exr {
                 
             }
             
-            const Imath::Box2i& datawin = inputfile->header().dataWindow();
-            const Imath::Box2i& dispwin = inputfile->header().displayWindow();
+            const Imath::Box2i& datawin = header.dataWindow();
+            const Imath::Box2i& dispwin = header.displayWindow();
+            
+            // each handle keeps a compressed and an uncompressed line (or tile) buffer for the parts it reads
+            size_t handleMemoryCost;
+            if (part.tiled) {
+                const Imf_::TileDescription& td = header.tileDescription();
+                handleMemoryCost = 2 * (size_t)td.xSize * td.ySize * pixelBytes;
+            } else {
+                handleMemoryCost = 2 * (size_t)(datawin.max.x - datawin.min.x + 1) * pixelBytes * linesInBuffer(header.compression());
+            }
+            _handleMemoryCost = std::max(_handleMemoryCost, handleMemoryCost);
+            
             Imath::Box2i formatwin(dispwin);
             formatwin.min.x = 0;
             formatwin.min.y = 0;
-            dataOffset = 0;
+            part.dataOffset = 0;
             
             if (dispwin.min.x != 0) {
                 // Shift both to get dispwindow over to 0,0.
-                dataOffset = -dispwin.min.x;
-                formatwin.max.x = dispwin.max.x + dataOffset;
+                part.dataOffset = -dispwin.min.x;
+                formatwin.max.x = dispwin.max.x + part.dataOffset;
             }
             formatwin.max.y = dispwin.max.y - dispwin.min.y;
             
-            displayWindow.x1 = 0;
-            displayWindow.y1 = 0;
-            displayWindow.x2 = formatwin.max.x + 1;
-            displayWindow.y2 = formatwin.max.y;
+            part.displayWindow.x1 = 0;
+            part.displayWindow.y1 = 0;
+            part.displayWindow.x2 = formatwin.max.x + 1;
+            part.displayWindow.y2 = formatwin.max.y;
             
-            int left = datawin.min.x + dataOffset;
+            int left = datawin.min.x + part.dataOffset;
             int bottom = dispwin.max.y - datawin.max.y;
-            int right = datawin.max.x + dataOffset;
+            int right = datawin.max.x + part.dataOffset;
             int top = dispwin.max.y - datawin.min.y;
             if (datawin.min.x != dispwin.min.x || datawin.max.x != dispwin.max.x ||
                 datawin.min.y != dispwin.min.y || datawin.max.y != dispwin.max.y) {
@@ -402,43 +627,129 @@ namespace Exr {
                 ++right;
                 ++top;
             }
-            dataWindow.x1 = left;
-            dataWindow.x2 = right + 1;
-            dataWindow.y1 = bottom;
-            dataWindow.y2 = top + 1;
+            part.dataWindow.x1 = left;
+            part.dataWindow.x2 = right + 1;
+            part.dataWindow.y1 = bottom;
+            part.dataWindow.y2 = top + 1;
             
-        }catch(const std::exception& e) {
-#ifdef _WIN32
-            delete inputStr;
-            delete inputStdStream;
-#endif
-            delete inputfile;
-            inputfile = 0;
-            throw e;
+            parts.push_back(part);
         }
+        
+        _freeHandles.push_back(handle.release());
+        _openHandles = 1;
+    }
+    
+    const File::Layer* File::findLayer(const std::string& name) const
+    {
+        for (std::vector<Layer>::const_iterator it = layers.begin(); it != layers.end(); ++it) {
+            if (it->name == name) {
+                return &*it;
+            }
+        }
+        if (name.empty() && !layers.empty()) {
+            // no channels without a layer prefix: use the first layer
+            return &layers.front();
+        }
+        return NULL;
     }
     
     File::~File(){
-#ifdef _WIN32
-        delete inputStr;
-        delete inputStdStream;
-#endif
-        delete inputfile;
+        for (std::list<InputHandle*>::iterator it = _freeHandles.begin(); it != _freeHandles.end(); ++it) {
+            delete *it;
+        }
     }
     
+    InputHandle* File::acquire()
+    {
+        {
+            OFX::MultiThread::AutoMutex g(_handlesLock);
+            if (!_freeHandles.empty()) {
+                InputHandle* handle = _freeHandles.front();
+                _freeHandles.pop_front();
+                return handle;
+            }
+            ++_openHandles;
+        }
+        // all handles are in use: open a new one (outside of the lock, this may take a while)
+        try {
+            return new InputHandle(filename);
+        } catch (...) {
+            OFX::MultiThread::AutoMutex g(_handlesLock);
+            --_openHandles;
+            throw;
+        }
+    }
+    
+    void File::release(InputHandle* handle)
+    {
+        assert(handle);
+        {
+            OFX::MultiThread::AutoMutex g(_handlesLock);
+            if (_freeHandles.size() < (size_t)kReadEXRMaxIdleHandlesPerFile) {
+                _freeHandles.push_back(handle);
+                return;
+            }
+            --_openHandles;
+        }
+        // enough handles are kept open already
+        delete handle;
+    }
+    
+    size_t File::memoryCost()
+    {
+        OFX::MultiThread::AutoMutex g(_handlesLock);
+        return sizeof(File) + _openHandles * _handleMemoryCost;
+    }
+    
+    // Checks out an input handle from a File for the lifetime of this object.
+    class InputHandleLocker
+    {
+    public:
+        InputHandleLocker(File* file)
+        : _file(file)
+        , _handle(file->acquire())
+        {
+        }
+        
+        ~InputHandleLocker()
+        {
+            _file->release(_handle);
+        }
+        
+        Imf_::MultiPartInputFile& operator*() const { return *_handle->inputfile; }
+        
+    private:
+        File* _file;
+        InputHandle* _handle;
+    };
+    
     // Keeps track of all Exr::File mapped against file name.
+    // The files are spread over several shards, each with its own lock, so that
+    // threads reading different files do not wait for each other.
+    // Each shard keeps its files in least recently used order, and closes the oldest ones
+    // when there are too many files or when their handles use too much memory.
     class FileManager
     {
-        typedef std::map<std::string, File*> FilesMap;
+        typedef std::list<File*> FilesList;
+        typedef std::map<std::string, FilesList::iterator> FilesMap;
+        
+        struct Shard {
+            FilesList lru; ///< most recently used first
+            FilesMap files;
+            OFX::MultiThread::Mutex *lock;
+        };
 
-        FilesMap _files;
+        Shard _shards[kReadEXRFileManagerShards];
+        size_t _maxFilesPerShard;
+        size_t _maxBytesPerShard;
         bool _isLoaded;///< register all "global" flags to ffmpeg outside of the constructor to allow
         /// all OpenFX related stuff (which depend on another singleton) to be allocated.
-
-#ifdef OFX_IO_MT_EXR
-        // internal lock
-        OFX::MultiThread::Mutex *_lock;
-#endif
+        
+        static unsigned int shardIndex(const std::string& filename);
+        
+        // remove the least recently used files of the shard until it fits the limits.
+        // Must be called with the shard lock held.
+        void evict(Shard& shard, std::list<File*>* toDelete);
         
     public:
         
@@ -452,57 +763,206 @@ namespace Exr {
         
         void initialize();
         
-        // get a specific reader
+        // get a specific reader. It must be given back with release().
         File* get(const std::string& filename);
+        
+        // give back a file obtained from get()
+        void release(File* file);
+        
+        // close all the files which are not in use
+        void clear();
     };
     
     FileManager FileManager::s_readerManager;
     
     // constructor
     FileManager::FileManager()
-    : _files()
+    : _maxFilesPerShard(0)
+    , _maxBytesPerShard(0)
     , _isLoaded(false)
-#ifdef OFX_IO_MT_EXR
-    , _lock(0)
-#endif
     {
+        for (int i = 0; i < kReadEXRFileManagerShards; ++i) {
+            _shards[i].lock = 0;
+        }
     }
     
     FileManager::~FileManager() {
-        for (FilesMap::iterator it = _files.begin(); it!= _files.end(); ++it) {
-            delete it->second;
+        for (int i = 0; i < kReadEXRFileManagerShards; ++i) {
+            for (FilesList::iterator it = _shards[i].lru.begin(); it!= _shards[i].lru.end(); ++it) {
+                delete *it;
+            }
+            delete _shards[i].lock;
         }
     }
     
+    // read a positive integer from the environment
+    static size_t getEnvSize(const char* name, size_t defaultValue)
+    {
+        const char* value = std::getenv(name);
+        if (value) {
+            long l = std::strtol(value, NULL, 10);
+            if (l > 0) {
+                return (size_t)l;
+            }
+        }
+        return defaultValue;
+    }
+    
     void FileManager::initialize() {
         if(!_isLoaded){
-#ifdef OFX_IO_MT_EXR
-            _lock = new OFX::MultiThread::Mutex();
-#endif
+            size_t maxFiles = getEnvSize(kReadEXRMaxOpenFilesEnv, kReadEXRMaxOpenFilesDefault);
+            size_t maxMB = getEnvSize(kReadEXRCacheSizeEnv, kReadEXRCacheSizeDefault);
+            _maxFilesPerShard = (maxFiles + kReadEXRFileManagerShards - 1) / kReadEXRFileManagerShards;
+            _maxBytesPerShard = ((maxMB << 20) + kReadEXRFileManagerShards - 1) / kReadEXRFileManagerShards;
+            for (int i = 0; i < kReadEXRFileManagerShards; ++i) {
+                _shards[i].lock = new OFX::MultiThread::Mutex();
+            }
             _isLoaded = true;
         }
         
     }
     
+    // FNV-1a hash of the file name
+    unsigned int FileManager::shardIndex(const std::string& filename)
+    {
+        unsigned int h = 2166136261u;
+        for (std::string::const_iterator it = filename.begin(); it != filename.end(); ++it) {
+            h = (h ^ (unsigned char)*it) * 16777619u;
+        }
+        return h % kReadEXRFileManagerShards;
+    }
+    
+    void FileManager::evict(Shard& shard, std::list<File*>* toDelete)
+    {
+        size_t bytes = 0;
+        for (FilesList::iterator it = shard.lru.begin(); it != shard.lru.end(); ++it) {
+            bytes += (*it)->memoryCost();
+        }
+        // never evict the file that was just used
+        while (shard.lru.size() > 1 && (shard.lru.size() > _maxFilesPerShard || bytes > _maxBytesPerShard)) {
+            File* file = shard.lru.back();
+            bytes -= std::min(bytes, file->memoryCost());
+            shard.lru.pop_back();
+            shard.files.erase(file->filename);
+            if (file->refCount == 0) {
+                toDelete->push_back(file);
+            } else {
+                // still being read by another thread, release() will delete it
+                file->evicted = true;
+            }
+        }
+    }
+    
     // get a specific reader
     File* FileManager::get(const std::string& filename)
     {
         
         assert(_isLoaded);
-#ifdef OFX_IO_MT_EXR
-        OFX::MultiThread::AutoMutex g(*_lock);
-#endif
-        FilesMap::iterator it = _files.find(filename);
-        if (it == _files.end()) {
-            std::pair<FilesMap::iterator,bool> ret = _files.insert(std::make_pair(std::string(filename), new File(filename)));
-            assert(ret.second);
-            return ret.first->second;
+        Shard& shard = _shards[shardIndex(filename)];
+        std::list<File*> toDelete;
+        File* file = 0;
+        {
+            OFX::MultiThread::AutoMutex g(*shard.lock);
+            FilesMap::iterator it = shard.files.find(filename);
+            if (it != shard.files.end()) {
+                // move it to the front, iterators stay valid
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                file = shard.lru.front();
+                ++file->refCount;
+                evict(shard, &toDelete);
+            }
+        }
+        if (!file) {
+            // opening the file and reading its headers may take a while: do it outside of the lock,
+            // so that the other files of the shard can still be read
+            std::auto_ptr<File> opened(new File(filename));
+            OFX::MultiThread::AutoMutex g(*shard.lock);
+            FilesMap::iterator it = shard.files.find(filename);
+            if (it == shard.files.end()) {
+                shard.lru.push_front(opened.release());
+                std::pair<FilesMap::iterator,bool> ret = shard.files.insert(std::make_pair(std::string(filename), shard.lru.begin()));
+                assert(ret.second);
+            } else {
+                // another thread opened it in the meantime: use its copy, and close ours
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                toDelete.push_back(opened.release());
+            }
+            file = shard.lru.front();
+            ++file->refCount;
+            evict(shard, &toDelete);
+        }
+        // closing files may take a while, do it outside of the lock
+        for (std::list<File*>::iterator it = toDelete.begin(); it != toDelete.end(); ++it) {
+            delete *it;
+        }
+        return file;
+    }
+    
+    void FileManager::release(File* file)
+    {
+        assert(_isLoaded && file);
+        Shard& shard = _shards[shardIndex(file->filename)];
+        bool mustDelete;
+        {
+            OFX::MultiThread::AutoMutex g(*shard.lock);
+            assert(file->refCount > 0);
+            --file->refCount;
+            mustDelete = file->evicted && file->refCount == 0;
         }
-        else {
-            return it->second;
+        if (mustDelete) {
+            delete file;
         }
     }
     
+    void FileManager::clear()
+    {
+        if (!_isLoaded) {
+            return;
+        }
+        for (int i = 0; i < kReadEXRFileManagerShards; ++i) {
+            Shard& shard = _shards[i];
+            std::list<File*> toDelete;
+            {
+                OFX::MultiThread::AutoMutex g(*shard.lock);
+                for (FilesList::iterator it = shard.lru.begin(); it != shard.lru.end(); ++it) {
+                    if ((*it)->refCount == 0) {
+                        toDelete.push_back(*it);
+                    } else {
+                        (*it)->evicted = true;
+                    }
+                }
+                shard.lru.clear();
+                shard.files.clear();
+            }
+            for (std::list<File*>::iterator it = toDelete.begin(); it != toDelete.end(); ++it) {
+                delete *it;
+            }
+        }
+    }
+    
+    // Holds a file obtained from the FileManager, so that it is not closed by
+    // the manager while it is in use.
+    class FileReference
+    {
+    public:
+        FileReference(const std::string& filename)
+        : _file(FileManager::s_readerManager.get(filename))
+        {
+        }
+        
+        ~FileReference()
+        {
+            FileManager::s_readerManager.release(_file);
+        }
+        
+        File* operator->() const { return _file; }
+        
+        File* get() const { return _file; }
+        
+    private:
+        File* _file;
+    };
+    
 }
 
 
@@ -510,8 +970,14 @@ namespace Exr {
 
 ReadEXRPlugin::ReadEXRPlugin(OfxImageEffectHandle handle)
 : GenericReaderPlugin(handle, kSupportsRGBA, kSupportsRGB, kSupportsAlpha, kSupportsTiles)
+, _layer(0)
+, _usePreview(0)
 {
     Exr::FileManager::s_readerManager.initialize();
+    _layer = fetchStringParam(kParamLayer);
+    assert(_layer);
+    _usePreview = fetchBooleanParam(kParamUsePreview);
+    assert(_usePreview);
 }
 
 ReadEXRPlugin::~ReadEXRPlugin(){
@@ -522,88 +988,550 @@ void
 ReadEXRPlugin::changedParam(const OFX::InstanceChangedArgs &args,
                             const std::string &paramName)
 {
-    GenericReaderPlugin::changedParam(args, paramName);
+    if (paramName == kParamLayer && args.reason != OFX::eChangeTime) {
+        // the output components and the bounds depend on the layer. The bounds are read from the layer by getFrameBounds.
+        updateComponentsFromFile();
+    } else {
+        GenericReaderPlugin::changedParam(args, paramName);
+    }
+}
+
+std::string
+ReadEXRPlugin::getLayerName()
+{
+    std::string layer;
+    _layer->getValue(layer);
+    return layer;
+}
+
+void
+ReadEXRPlugin::clearAnyCache()
+{
+    // close all the files which are not being read
+    Exr::FileManager::s_readerManager.clear();
 }
 
 struct DecodingChannelsMap {
-    float* buf;
-    bool subsampled;
+    int channelIndex;
+    Imf_::PixelType type;
+    int xSampling;
+    int ySampling;
+    float fillValue; ///< value of the channel if it is missing from the layer
     std::string channelName;
 };
 
+// Get the channels of the layer to insert in the FrameBuffer. Missing RGB channels are filled with
+// 0, and a missing alpha is filled with 1, by inserting a slice for a channel which is not in the file.
+static void
+getDecodingChannels(const Exr::File::Part& part,
+                    const Exr::File::Layer& layer,
+                    std::vector<DecodingChannelsMap>* channels)
+{
+    for (int c = Exr::Channel_red; c <= Exr::Channel_alpha; ++c) {
+        DecodingChannelsMap d;
+        ///This means we only support FLOAT dst images with the RGBA format.
+        d.channelIndex = c;
+        d.type = Imf_::HALF; // missing channels can be filled in any type
+        d.xSampling = 1;
+        d.ySampling = 1;
+        d.fillValue = (c == Exr::Channel_alpha) ? 1.f : 0.f;
+        Exr::File::ChannelsMap::const_iterator it = layer.channel_map.find((Exr::Channel)c);
+        const Imf_::Channel* channel = (it == layer.channel_map.end()) ? NULL : part.header.channels().findChannel(it->second.c_str());
+        if (channel) {
+            d.channelName = it->second;
+            d.type = channel->type;
+            d.xSampling = channel->xSampling;
+            d.ySampling = channel->ySampling;
+        } else {
+            d.channelName = std::string(kReadEXRFillChannelPrefix) + (char)('0' + c);
+        }
+        channels->push_back(d);
+    }
+}
+
+// fill the given rectangle of a RGBA float buffer with zeroes
+static void
+fillRectWithBlack(const OfxRectI& rect,
+                  float *pixelData,
+                  const OfxRectI& bounds,
+                  int rowBytes)
+{
+    if (isRectNull(rect)) {
+        return;
+    }
+    for (int y = rect.y1; y < rect.y2; ++y) {
+        float* dst = (float*)((char*)pixelData + (ptrdiff_t)(y - bounds.y1) * rowBytes) + (rect.x1 - bounds.x1) * 4;
+        std::memset(dst, 0, (rect.x2 - rect.x1) * 4 * sizeof(float));
+    }
+}
+
+// Fill the parts of the render window which are outside of readWindow with black
+static void
+fillMarginsWithBlack(const OfxRectI& renderWindow,
+                     const OfxRectI& readWindow,
+                     float *pixelData,
+                     const OfxRectI& bounds,
+                     int rowBytes)
+{
+    OfxRectI r = renderWindow;
+    r.y2 = readWindow.y1;
+    fillRectWithBlack(r, pixelData, bounds, rowBytes); // below
+    r.y1 = readWindow.y2;
+    r.y2 = renderWindow.y2;
+    fillRectWithBlack(r, pixelData, bounds, rowBytes); // above
+    r.y1 = readWindow.y1;
+    r.y2 = readWindow.y2;
+    r.x2 = readWindow.x1;
+    fillRectWithBlack(r, pixelData, bounds, rowBytes); // left
+    r.x1 = readWindow.x2;
+    r.x2 = renderWindow.x2;
+    fillRectWithBlack(r, pixelData, bounds, rowBytes); // right
+}
+
+// True if the preview image of the part can be used instead of the mipmap level 'level', i.e. if the
+// level is not in the file and the preview is at least as large. The preview only shows the RGBA
+// channels without a layer prefix.
+static bool
+canUsePreview(const Exr::File::Part& part,
+              const Exr::File::Layer& layer,
+              unsigned int level)
+{
+    if (level == 0 || (int)level < part.numLevels || !layer.name.empty() || !part.header.hasPreviewImage()) {
+        return false;
+    }
+    const Imf_::PreviewImage& preview = part.header.previewImage();
+    const OfxRectI levelWindow = downscalePowerOfTwoSmallestEnclosing(part.dataWindow, level);
+    // the preview height is rounded down by the writers
+    return (int)preview.width() >= levelWindow.x2 - levelWindow.x1 && (int)preview.height() + 1 >= levelWindow.y2 - levelWindow.y1;
+}
+
+// Range [*p1,*p2) of the preview pixels covering [x1,x2) in a data window range [d1,d1+dataSize)
+static void
+previewRange(int x1,
+             int x2,
+             int d1,
+             int dataSize,
+             int previewSize,
+             int* p1,
+             int* p2)
+{
+    *p1 = std::min((int)((long long)(x1 - d1) * previewSize / dataSize), previewSize - 1);
+    *p2 = std::min((int)(((long long)(x2 - d1) * previewSize + dataSize - 1) / dataSize), previewSize);
+    *p2 = std::max(*p2, *p1 + 1);
+}
+
+// Decode the render window at mipmap level 'level' from the preview image of the part, without
+// decompressing any pixel. Each pixel is the average of the preview pixels it covers.
+static void
+decodePreview(const Exr::File::Part& part,
+              unsigned int level,
+              const OfxRectI& renderWindow,
+              float *pixelData,
+              const OfxRectI& bounds,
+              int rowBytes)
+{
+    const Imf_::PreviewImage& preview = part.header.previewImage();
+    const int previewWidth = preview.width();
+    const int previewHeight = preview.height();
+    const OfxRectI& dataWindow = part.dataWindow;
+    const int dataWidth = dataWindow.x2 - dataWindow.x1;
+    const int dataHeight = dataWindow.y2 - dataWindow.y1;
+
+    OfxRectI readWindow;
+    if (!intersect(renderWindow, downscalePowerOfTwoSmallestEnclosing(dataWindow, level), &readWindow) || isRectNull(readWindow)) {
+        fillRectWithBlack(renderWindow, pixelData, bounds, rowBytes);
+        return;
+    }
+    fillMarginsWithBlack(renderWindow, readWindow, pixelData, bounds, rowBytes);
+
+    // previews are encoded with a 2.2 gamma
+    float toLinear[256];
+    for (int i = 0; i < 256; ++i) {
+        toLinear[i] = std::pow(i / 255.f, 2.2f);
+    }
+
+    // the preview columns covered by each column of the read window
+    const int width = readWindow.x2 - readWindow.x1;
+    std::vector<int> previewX1(width);
+    std::vector<int> previewX2(width);
+    for (int x = readWindow.x1; x < readWindow.x2; ++x) {
+        const int x1 = std::max(x << level, dataWindow.x1);
+        const int x2 = std::min((x + 1) << level, dataWindow.x2);
+        previewRange(x1, x2, dataWindow.x1, dataWidth, previewWidth, &previewX1[x - readWindow.x1], &previewX2[x - readWindow.x1]);
+    }
+
+    for (int y = readWindow.y1; y < readWindow.y2; ++y) {
+        // preview lines go from top to bottom
+        const int y1 = std::max(y << level, dataWindow.y1);
+        const int y2 = std::min((y + 1) << level, dataWindow.y2);
+        int previewY1, previewY2;
+        previewRange(dataWindow.y2 - y2, dataWindow.y2 - y1, 0, dataHeight, previewHeight, &previewY1, &previewY2);
+        float* dst = (float*)((char*)pixelData + (ptrdiff_t)(y - bounds.y1) * rowBytes) + (readWindow.x1 - bounds.x1) * 4;
+        for (int i = 0; i < width; ++i, dst += 4) {
+            float sum[4] = { 0.f, 0.f, 0.f, 0.f };
+            for (int py = previewY1; py < previewY2; ++py) {
+                for (int px = previewX1[i]; px < previewX2[i]; ++px) {
+                    const Imf_::PreviewRgba& rgba = preview.pixel(px, py);
+                    sum[0] += toLinear[rgba.r];
+                    sum[1] += toLinear[rgba.g];
+                    sum[2] += toLinear[rgba.b];
+                    sum[3] += rgba.a / 255.f;
+                }
+            }
+            const float norm = 1.f / ((previewY2 - previewY1) * (previewX2[i] - previewX1[i]));
+            for (int c = 0; c < 4; ++c) {
+                dst[c] = sum[c] * norm;
+            }
+        }
+    }
+}
+
 void
 ReadEXRPlugin::decode(const std::string& filename,
-                      OfxTime /*time*/,
+                      OfxTime time,
                       const OfxRectI& renderWindow,
                       float *pixelData,
                       const OfxRectI& bounds,
                       OFX::PixelComponentEnum pixelComponents,
                       int rowBytes)
+{
+    decodeMipmapLevel(filename, time, 0, renderWindow, pixelData, bounds, pixelComponents, rowBytes);
+}
+
+// Convert n pixels from four planes of halfs to interleaved RGBA floats
+static void
+interleaveHalfToFloat(const half* const planes[4],
+                      int n,
+                      float* dst)
+{
+    int i = 0;
+#if defined(__F16C__) && defined(__AVX__)
+    // 8 pixels at a time: convert each channel with F16C, then transpose the 4x8 block
+    for (; i + 8 <= n; i += 8, dst += 32) {
+        __m256 r = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(planes[0] + i)));
+        __m256 g = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(planes[1] + i)));
+        __m256 b = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(planes[2] + i)));
+        __m256 a = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(planes[3] + i)));
+        __m256 rg_lo = _mm256_unpacklo_ps(r, g); // r0 g0 r1 g1 | r4 g4 r5 g5
+        __m256 rg_hi = _mm256_unpackhi_ps(r, g); // r2 g2 r3 g3 | r6 g6 r7 g7
+        __m256 ba_lo = _mm256_unpacklo_ps(b, a);
+        __m256 ba_hi = _mm256_unpackhi_ps(b, a);
+        __m256 p0 = _mm256_shuffle_ps(rg_lo, ba_lo, _MM_SHUFFLE(1, 0, 1, 0)); // pixels 0 | 4
+        __m256 p1 = _mm256_shuffle_ps(rg_lo, ba_lo, _MM_SHUFFLE(3, 2, 3, 2)); // pixels 1 | 5
+        __m256 p2 = _mm256_shuffle_ps(rg_hi, ba_hi, _MM_SHUFFLE(1, 0, 1, 0)); // pixels 2 | 6
+        __m256 p3 = _mm256_shuffle_ps(rg_hi, ba_hi, _MM_SHUFFLE(3, 2, 3, 2)); // pixels 3 | 7
+        _mm256_storeu_ps(dst,      _mm256_permute2f128_ps(p0, p1, 0x20));
+        _mm256_storeu_ps(dst + 8,  _mm256_permute2f128_ps(p2, p3, 0x20));
+        _mm256_storeu_ps(dst + 16, _mm256_permute2f128_ps(p0, p1, 0x31));
+        _mm256_storeu_ps(dst + 24, _mm256_permute2f128_ps(p2, p3, 0x31));
+    }
+#endif
+    for (; i < n; ++i, dst += 4) {
+        dst[0] = planes[0][i];
+        dst[1] = planes[1][i];
+        dst[2] = planes[2][i];
+        dst[3] = planes[3][i];
+    }
+}
+
+// Insert the slices to decode a region of the file of the given size, starting at (x0,y0), into buffer.
+// If halfPlanar, the four channels are stored as consecutive planes of halfs, else as interleaved RGBA floats.
+// The strides of subsampled channels are multiplied by their sampling rates, so that each sample is stored
+// at the position of its full resolution pixel: the other pixels must then be filled by upsampleChannels().
+static void
+insertSlices(const std::vector<DecodingChannelsMap>& channels,
+             bool halfPlanar,
+             char* buffer,
+             int x0,
+             int y0,
+             int width,
+             int height,
+             Imf_::FrameBuffer* fbuf)
+{
+    for (std::vector<DecodingChannelsMap>::const_iterator z = channels.begin(); z != channels.end(); ++z) {
+        if (halfPlanar) {
+            char* plane = buffer + (size_t)z->channelIndex * width * height * sizeof(half);
+            char* origin = plane - (ptrdiff_t)x0 * (ptrdiff_t)sizeof(half) - (ptrdiff_t)y0 * (ptrdiff_t)(width * sizeof(half));
+            fbuf->insert(z->channelName.c_str(), Imf_::Slice(Imf_::HALF, origin, sizeof(half), width * sizeof(half),
+                                                             1, 1, z->fillValue));
+        } else {
+            const size_t pixelStride = sizeof(float) * 4;
+            char* origin = buffer - (ptrdiff_t)x0 * (ptrdiff_t)pixelStride - (ptrdiff_t)y0 * (ptrdiff_t)(width * pixelStride);
+            fbuf->insert(z->channelName.c_str(), Imf_::Slice(Imf_::FLOAT, origin + z->channelIndex * sizeof(float),
+                                                             pixelStride * z->xSampling, width * pixelStride * z->ySampling,
+                                                             z->xSampling, z->ySampling, z->fillValue));
+        }
+    }
+}
+
+// Fill the pixels of the subsampled channels of a RGBA float buffer filled by insertSlices() with the value
+// of their sample. (x0,y0), the file coordinates of the first pixel, must be multiples of the sampling rates.
+static void
+upsampleChannels(const std::vector<DecodingChannelsMap>& channels,
+                 char* buffer,
+                 int x0,
+                 int y0,
+                 int width,
+                 int height)
+{
+    for (std::vector<DecodingChannelsMap>::const_iterator z = channels.begin(); z != channels.end(); ++z) {
+        if (z->xSampling == 1 && z->ySampling == 1) {
+            continue;
+        }
+        assert(x0 % z->xSampling == 0 && y0 % z->ySampling == 0);
+        float* data = (float*)buffer + z->channelIndex;
+        for (int y = 0; y < height; ++y) {
+            const float* src = data + (size_t)(y - y % z->ySampling) * width * 4;
+            float* dst = data + (size_t)y * width * 4;
+            for (int x = 0; x < width; ++x) {
+                dst[x * 4] = src[(x - x % z->xSampling) * 4];
+            }
+        }
+    }
+}
+
+// Copy n pixels starting at column x of a line of a buffer filled by insertSlices() to interleaved RGBA floats
+static void
+copyLine(bool halfPlanar,
+         const char* buffer,
+         int width,
+         int height,
+         int line,
+         int x,
+         int n,
+         float* dst)
+{
+    if (halfPlanar) {
+        const size_t planeSize = (size_t)width * height;
+        const half* planes[4];
+        for (int c = 0; c < 4; ++c) {
+            planes[c] = (const half*)buffer + c * planeSize + (size_t)line * width + x;
+        }
+        interleaveHalfToFloat(planes, n, dst);
+    } else {
+        std::memcpy(dst, (const float*)buffer + ((size_t)line * width + x) * 4, n * 4 * sizeof(float));
+    }
+}
+
+unsigned int
+ReadEXRPlugin::getFileMipmapLevel(const std::string& filename,
+                                  OfxTime /*time*/,
+                                  unsigned int level)
+{
+    Exr::FileReference file(filename);
+    const Exr::File::Layer* layer = file->findLayer(getLayerName());
+    if (!layer) {
+        return 0;
+    }
+    const Exr::File::Part& part = file->parts[layer->part];
+    bool usePreview;
+    _usePreview->getValue(usePreview);
+    if (usePreview && canUsePreview(part, *layer, level)) {
+        return level;
+    }
+    return std::min(level, (unsigned int)(part.numLevels - 1));
+}
+
+void
+ReadEXRPlugin::decodeMipmapLevel(const std::string& filename,
+                                 OfxTime /*time*/,
+                                 unsigned int level,
+                                 const OfxRectI& renderWindow,
+                                 float *pixelData,
+                                 const OfxRectI& bounds,
+                                 OFX::PixelComponentEnum pixelComponents,
+                                 int rowBytes)
 {
     /// we only support RGBA output clip
     if (pixelComponents != OFX::ePixelComponentRGBA) {
         OFX::throwSuiteStatusException(kOfxStatErrFormat);
     }
 
-    Exr::File* file = Exr::FileManager::s_readerManager.get(filename);
-    OfxRectI roi = bounds; // used to be dstImg->getRegionOfDefinition(); why?
-    assert(kSupportsTiles || (renderWindow.x1 == file->dataWindow.x1 && renderWindow.x2 == file->dataWindow.x2 && renderWindow.y1 == file->dataWindow.y1 && renderWindow.y2 == file->dataWindow.y2));
-
-    for (int y = roi.y1; y < roi.y2; ++y) {
-        
-        
-        std::map<Exr::Channel, DecodingChannelsMap > channels;
-        for (Exr::File::ChannelsMap::const_iterator it = file->channel_map.begin(); it!=file->channel_map.end(); ++it) {
-            DecodingChannelsMap d;
-            
-            ///This line means we only support FLOAT dst images with the RGBA format.
-            d.buf = (float*)((char*)pixelData + (y-roi.y1)*rowBytes) + (int)it->first;
-            
-            d.subsampled = it->second == "BY" || it->second == "RY";
-            d.channelName = it->second;
-            channels.insert(std::make_pair(it->first, d));
+    Exr::FileReference file(filename);
+    std::string layerName = getLayerName();
+    const Exr::File::Layer* layer = file->findLayer(layerName);
+    if (!layer) {
+        if (layerName.empty()) {
+            // no RGBA channels in this file
+            fillRectWithBlack(renderWindow, pixelData, bounds, rowBytes);
+            return;
         }
-        
-        const Imath::Box2i& dispwin = file->inputfile->header().displayWindow();
-        const Imath::Box2i& datawin = file->inputfile->header().dataWindow();
-        int exrY = dispwin.max.y - y;
-        //int r = roi.x2;
-        //int x = roi.x1;
-        
-        //const int X = std::max(x, datawin.min.x + file->dataOffset);
-        //const int R = std::min(r, datawin.max.x + file->dataOffset + 1);
-        
-        // if we're below or above the data window
-        if (exrY < datawin.min.y || exrY > datawin.max.y/* || R <= X*/) {
-            continue;
+        setPersistentMessage(OFX::Message::eMessageError, "", std::string("EXR: cannot find layer ") + layerName + " in " + filename);
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    const Exr::File::Part& part = file->parts[layer->part];
+    if ((int)level >= part.numLevels) {
+        // only getFileMipmapLevel() returns levels which are not in the file, when the preview can be used
+        if (!canUsePreview(part, *layer, level)) {
+            OFX::throwSuiteStatusException(kOfxStatFailed);
         }
-        
-        Imf_::FrameBuffer fbuf;
-        for (std::map<Exr::Channel,DecodingChannelsMap >::const_iterator z = channels.begin(); z != channels.end();++z) {
-            if( !z->second.subsampled) {
-                fbuf.insert(z->second.channelName.c_str(),
-                            Imf_::Slice(Imf_::FLOAT,(char*)(z->second.buf /*+ file->dataOffset*/),sizeof(float) * 4, 0));
-            } else {
-                fbuf.insert(z->second.channelName.c_str(),
-                            Imf_::Slice(Imf_::FLOAT,(char*)(z->second.buf /*+ file->dataOffset*/),sizeof(float) * 4, 0,2,2));
+        decodePreview(part, level, renderWindow, pixelData, bounds, rowBytes);
+        return;
+    }
+    const Imath::Box2i& dispwin = part.header.displayWindow();
+    const Imath::Box2i& datawin = part.header.dataWindow();
+    Exr::InputHandleLocker inputfile(file.get());
+
+    // the pixels actually stored in the file at level 0, in OpenFX pixel coordinates (y is flipped)
+    OfxRectI fileWindow;
+    fileWindow.x1 = datawin.min.x + part.dataOffset;
+    fileWindow.x2 = datawin.max.x + part.dataOffset + 1;
+    fileWindow.y1 = dispwin.max.y - datawin.max.y;
+    fileWindow.y2 = dispwin.max.y - datawin.min.y + 1;
+
+    // The data window of a level has the same origin as the full resolution data window, and a size
+    // divided by 2^level. The level is placed at the full resolution position downscaled by 2^level,
+    // and its top-left pixel is aligned with the top-left pixel of the full resolution data window.
+    Imath::Box2i levelwin = datawin;
+    if (level > 0) {
+        assert(part.tiled);
+        levelwin = Imf_::TiledInputPart(*inputfile, part.index).dataWindowForLevel(level, level);
+        const int pot_minus1 = (1 << level) - 1;
+        const int top = (fileWindow.y2 + pot_minus1) >> level;
+        fileWindow.x1 = fileWindow.x1 >> level;
+        fileWindow.x2 = fileWindow.x1 + (levelwin.max.x - levelwin.min.x + 1);
+        fileWindow.y2 = top;
+        fileWindow.y1 = top - (levelwin.max.y - levelwin.min.y + 1);
+    }
+    // the OpenFX pixel coordinates of pixel (x,y) in the level are (x + exrToOfxX, exrToOfxY - y)
+    const int exrToOfxX = fileWindow.x1 - levelwin.min.x;
+    const int exrToOfxY = fileWindow.y2 - 1 + levelwin.min.y;
+
+    // only decode the scan lines (or tiles) that intersect the render window
+    OfxRectI readWindow;
+    if (!intersect(renderWindow, fileWindow, &readWindow) || isRectNull(readWindow)) {
+        fillRectWithBlack(renderWindow, pixelData, bounds, rowBytes);
+        return;
+    }
+
+    // the parts of the render window which are not in the file are black
+    fillMarginsWithBlack(renderWindow, readWindow, pixelData, bounds, rowBytes);
+
+    // only the channels of the layer are decoded, and only the chunks of its part are read
+    std::vector<DecodingChannelsMap> channels;
+    getDecodingChannels(part, *layer, &channels);
+
+    // the part of the level to read, in the file coordinates
+    const int exrXMin = readWindow.x1 - exrToOfxX;
+    const int exrXMax = readWindow.x2 - 1 - exrToOfxX;
+    const int exrYMin = exrToOfxY - (readWindow.y2 - 1);
+    const int exrYMax = exrToOfxY - readWindow.y1;
+    const int copyWidth = readWindow.x2 - readWindow.x1;
+
+    // Half channels are decoded as is into planes, and converted and interleaved in a single pass,
+    // rather than letting OpenEXR convert them one value at a time into the interleaved buffer.
+    // Subsampled channels (e.g. the chroma of luminance/chroma images) are upsampled after decoding, and
+    // the decoded lines must start on a line which contains samples of all the channels.
+    bool halfPlanar = true;
+    bool subsampled = false;
+    int ySamplingAlign = 1;
+    for (std::vector<DecodingChannelsMap>::const_iterator z = channels.begin(); z != channels.end(); ++z) {
+        if (z->xSampling != 1 || z->ySampling != 1) {
+            subsampled = true;
+            halfPlanar = false;
+            int a = ySamplingAlign;
+            int b = z->ySampling;
+            while (b != 0) {
+                const int t = a % b;
+                a = b;
+                b = t;
             }
-            
+            ySamplingAlign = ySamplingAlign / a * z->ySampling;
+        } else if (z->type != Imf_::HALF) {
+            halfPlanar = false;
         }
-        {
-#ifdef OFX_IO_MT_EXR
-            OFX::MultiThread::AutoMutex locker(file->lock);
-#endif
+    }
+    const size_t bufferPixelBytes = halfPlanar ? 4 * sizeof(half) : 4 * sizeof(float);
+
+    if (part.tiled) {
+        // Decode the tiles row by row into a temporary buffer, and copy the requested part.
+        // Tiles may extend beyond the render window, so they can't be decoded in place.
+        Imf_::TiledInputPart tiledpart(*inputfile, part.index);
+        const int tileW = tiledpart.tileXSize();
+        const int tileH = tiledpart.tileYSize();
+        const int dx1 = (exrXMin - levelwin.min.x) / tileW;
+        const int dx2 = (exrXMax - levelwin.min.x) / tileW;
+        const int dy1 = (exrYMin - levelwin.min.y) / tileH;
+        const int dy2 = (exrYMax - levelwin.min.y) / tileH;
+        const int tilesX = levelwin.min.x + dx1 * tileW; // first column of the decoded tiles
+        const int tilesWidth = (dx2 - dx1 + 1) * tileW;
+        std::vector<char> tiles((size_t)tilesWidth * tileH * bufferPixelBytes);
+
+        for (int dy = dy1; dy <= dy2; ++dy) {
+            const int tilesY = levelwin.min.y + dy * tileH; // first line of this row of tiles
+            Imf_::FrameBuffer fbuf;
+            insertSlices(channels, halfPlanar, &tiles[0], tilesX, tilesY, tilesWidth, tileH, &fbuf);
             try {
-                file->inputfile->setFrameBuffer(fbuf);
-                file->inputfile->readPixels(exrY);
+                tiledpart.setFrameBuffer(fbuf);
+                tiledpart.readTiles(dx1, dx2, dy, dy, level, level);
             } catch (const std::exception& e) {
                 setPersistentMessage(OFX::Message::eMessageError, "",std::string("OpenEXR error") + ": " + e.what());
                 return;
             }
+            const int y1 = std::max(exrYMin, tilesY);
+            const int y2 = std::min(exrYMax, tilesY + tileH - 1);
+            for (int exrY = y1; exrY <= y2; ++exrY) {
+                float* dst = (float*)((char*)pixelData + (ptrdiff_t)(exrToOfxY - exrY - bounds.y1) * rowBytes) + (readWindow.x1 - bounds.x1) * 4;
+                copyLine(halfPlanar, &tiles[0], tilesWidth, tileH, exrY - tilesY, exrXMin - tilesX, copyWidth, dst);
+            }
+        }
+        return;
+    }
+
+    assert(level == 0);
+    Imf_::InputPart inputpart(*inputfile, part.index);
+
+    if (!halfPlanar && !subsampled && fileWindow.x1 >= renderWindow.x1 && fileWindow.x2 <= renderWindow.x2) {
+        // the full scan lines fit in the render window: decode directly into the destination buffer.
+        // The slice base is the address of pixel (0,0) of the file, and the y stride is negative since y is flipped.
+        const size_t pixelStride = sizeof(float) * 4;
+        char* origin = (char*)pixelData + (ptrdiff_t)(exrToOfxY - bounds.y1) * rowBytes + (ptrdiff_t)(exrToOfxX - bounds.x1) * (ptrdiff_t)pixelStride;
+        Imf_::FrameBuffer fbuf;
+        for (std::vector<DecodingChannelsMap>::const_iterator z = channels.begin(); z != channels.end(); ++z) {
+            fbuf.insert(z->channelName.c_str(), Imf_::Slice(Imf_::FLOAT, origin + z->channelIndex * sizeof(float), pixelStride, -(ptrdiff_t)rowBytes,
+                                                            z->xSampling, z->ySampling, z->fillValue));
+        }
+        try {
+            inputpart.setFrameBuffer(fbuf);
+            inputpart.readPixels(exrYMin, exrYMax);
+        } catch (const std::exception& e) {
+            setPersistentMessage(OFX::Message::eMessageError, "",std::string("OpenEXR error") + ": " + e.what());
+            return;
+        }
+        return;
+    }
+
+    // Scan lines are always decoded in full, so if the render window is narrower than the data window
+    // (e.g. a tile), or if the channels are converted afterwards, decode them by chunks into a temporary
+    // buffer and only copy the requested columns.
+    // With subsampled channels, the chunks start on multiples of the vertical sampling rates (the data window
+    // origin is always a multiple of the sampling rates), so that each chunk contains the samples of its lines.
+    const int dataWidth = datawin.max.x - datawin.min.x + 1;
+    const int readYMin = exrYMin - (exrYMin - datawin.min.y) % ySamplingAlign;
+    int chunkLines = std::min(kReadEXRScanLinesPerChunk, exrYMax - readYMin + 1);
+    chunkLines = (chunkLines + ySamplingAlign - 1) / ySamplingAlign * ySamplingAlign;
+    std::vector<char> chunk((size_t)dataWidth * chunkLines * bufferPixelBytes);
+    const int copyX = exrXMin - datawin.min.x;
+
+    for (int y1 = readYMin; y1 <= exrYMax; y1 += chunkLines) {
+        const int y2 = std::min(y1 + chunkLines - 1, exrYMax);
+        Imf_::FrameBuffer fbuf;
+        insertSlices(channels, halfPlanar, &chunk[0], datawin.min.x, y1, dataWidth, chunkLines, &fbuf);
+        try {
+            inputpart.setFrameBuffer(fbuf);
+            inputpart.readPixels(y1, y2);
+        } catch (const std::exception& e) {
+            setPersistentMessage(OFX::Message::eMessageError, "",std::string("OpenEXR error") + ": " + e.what());
+            return;
+        }
+        if (subsampled) {
+            upsampleChannels(channels, &chunk[0], datawin.min.x, y1, dataWidth, y2 - y1 + 1);
+        }
+        for (int exrY = std::max(y1, exrYMin); exrY <= y2; ++exrY) {
+            float* dst = (float*)((char*)pixelData + (ptrdiff_t)(exrToOfxY - exrY - bounds.y1) * rowBytes) + (readWindow.x1 - bounds.x1) * 4;
+            copyLine(halfPlanar, &chunk[0], dataWidth, chunkLines, exrY - y1, copyX, copyWidth, dst);
         }
-        
     }
-    
 }
 
 void
@@ -612,16 +1540,19 @@ ReadEXRPlugin::onInputFileChanged(const std::string& newFile,
                                   OFX::PixelComponentEnum *components)
 {
     assert(premult && components);
-    Exr::File* file = Exr::FileManager::s_readerManager.get(newFile);
-    bool hasRed;
-    bool hasGreen;
-    bool hasBlue;
-    bool hasAlpha;
+    Exr::FileReference file(newFile);
+    bool hasRed = false;
+    bool hasGreen = false;
+    bool hasBlue = false;
+    bool hasAlpha = false;
     
-    hasRed = file->channel_map.find(Exr::Channel_red) != file->channel_map.end();
-    hasGreen = file->channel_map.find(Exr::Channel_green) != file->channel_map.end();
-    hasBlue = file->channel_map.find(Exr::Channel_blue) != file->channel_map.end();
-    hasAlpha = file->channel_map.find(Exr::Channel_alpha) != file->channel_map.end();
+    const Exr::File::Layer* layer = file->findLayer(getLayerName());
+    if (layer) {
+        hasRed = layer->channel_map.find(Exr::Channel_red) != layer->channel_map.end();
+        hasGreen = layer->channel_map.find(Exr::Channel_green) != layer->channel_map.end();
+        hasBlue = layer->channel_map.find(Exr::Channel_blue) != layer->channel_map.end();
+        hasAlpha = layer->channel_map.find(Exr::Channel_alpha) != layer->channel_map.end();
+    }
     
     if (hasAlpha) {
         // if any color channel is present, let it be RGBA
@@ -651,17 +1582,20 @@ ReadEXRPlugin::getFrameBounds(const std::string& filename,
                               std::string *error)
 {
     assert(bounds && par);
-    Exr::File* file = Exr::FileManager::s_readerManager.get(filename);
-    if (!file) {
+    Exr::FileReference file(filename);
+    if (!file.get() || file->parts.empty()) {
         if (error) {
             *error = "No such file";
         }
         return false;
     }
-    bounds->x1 = file->dataWindow.x1;
-    bounds->x2 = file->dataWindow.x2;
-    bounds->y1 = file->dataWindow.y1;
-    bounds->y2 = file->dataWindow.y2;
+    // the bounds are those of the part containing the layer
+    const Exr::File::Layer* layer = file->findLayer(getLayerName());
+    const Exr::File::Part& part = file->parts[layer ? layer->part : 0];
+    bounds->x1 = part.dataWindow.x1;
+    bounds->x2 = part.dataWindow.x2;
+    bounds->y1 = part.dataWindow.y1;
+    bounds->y2 = part.dataWindow.y2;
 #pragma message WARN("TODO: get PAR for EXR")
     *par = 1.0;
 
@@ -670,7 +1604,7 @@ ReadEXRPlugin::getFrameBounds(const std::string& filename,
 
 using namespace OFX;
 
-mDeclareReaderPluginFactory(ReadEXRPluginFactory, {}, {},false);
+mDeclareReaderPluginFactory(ReadEXRPluginFactory, { Exr::setGlobalThreadCount(); }, {},false);
 
 /** @brief The basic describe function, passed a plugin descriptor */
 void
@@ -680,9 +1614,8 @@ ReadEXRPluginFactory::describe(OFX::ImageEffectDescriptor &desc)
     // basic labels
     desc.setLabels("ReadEXROFX", "ReadEXROFX", "ReadEXROFX");
     desc.setPluginDescription("Read EXR images using OpenEXR.");
-#ifdef OFX_IO_MT_EXR
+    // each render checks out its own Imf::InputFile, see Exr::File::acquire()
     desc.setRenderThreadSafety(eRenderFullySafe);
-#endif
 
 #ifdef OFX_EXTENSIONS_TUTTLE
     const char* extensions[] = { "exr", NULL };
@@ -700,6 +1633,25 @@ ReadEXRPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
     PageParamDescriptor *page = GenericReaderDescribeInContextBegin(desc, context, isVideoStreamPlugin(),
                                                                     kSupportsRGBA, kSupportsRGB, kSupportsAlpha, kSupportsTiles);
 
+    //////////Layer
+    {
+        OFX::StringParamDescriptor* param = desc.defineStringParam(kParamLayer);
+        param->setLabels(kParamLayerLabel, kParamLayerLabel, kParamLayerLabel);
+        param->setHint(kParamLayerHint);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
+    //////////Use preview
+    {
+        OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kParamUsePreview);
+        param->setLabels(kParamUsePreviewLabel, kParamUsePreviewLabel, kParamUsePreviewLabel);
+        param->setHint(kParamUsePreviewHint);
+        param->setDefault(true);
+        param->setAnimates(false);
+        page->addChild(*param);
+    }
+
     GenericReaderDescribeInContextEnd(desc, context, page, "reference", "reference");
 }
 
@@ -38,19 +38,39 @@
  */
 #include "WriteEXR.h"
 
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstddef>
+#include <fstream>
+#include <map>
 #include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+#include <OpenEXRConfig.h>
 #include <ImfChannelList.h>
-#include <ImfArray.h>
 #include <ImfOutputFile.h>
+#include <ImfTiledOutputFile.h>
+#include <ImfTileDescription.h>
+#include <ImfStandardAttributes.h>
+#include <ImfPreviewImage.h>
 #include <half.h>
 
+#if defined(__F16C__) && defined(__AVX__)
+#include <immintrin.h>
+#endif
 
-#include <ImfChannelList.h>
-#include <ImfArray.h>
-#include <ImfOutputFile.h>
-#include <half.h>
+#include <ofxsMultiThread.h>
 
 #include "GenericWriter.h"
+#include "EXRThreadCount.h"
 
 #define kPluginName "WriteEXR"
 #define kPluginGrouping "Image/Writers"
@@ -61,11 +81,42 @@
 
 #define kWriteEXRCompressionParamName "compression"
 #define kWriteEXRDataTypeParamName "dataType"
+#define kWriteEXRZipLevelParamName "zipCompressionLevel"
+#define kWriteEXRZipLevelParamLabel "Zip Level"
+#define kWriteEXRZipLevelParamHint "Compression level of the Zip compressions, from 1 (fastest) to 9 (smallest files). Requires OpenEXR 3.1 or later."
+#define kWriteEXRDwaLevelParamName "dwaCompressionLevel"
+#define kWriteEXRDwaLevelParamLabel "DWA Level"
+#define kWriteEXRDwaLevelParamHint "Compression level of the DWAA and DWAB compressions. Higher values give smaller files and lower quality. 45 is visually lossless for most images."
+#define kWriteEXRAutoCropParamName "autoCrop"
+#define kWriteEXRAutoCropParamLabel "Auto Crop"
+#define kWriteEXRAutoCropParamHint "Write only the smallest data window that contains all the non-zero pixels of the image. This makes files of sparse images (CG elements, mattes) smaller and faster to write and read, and readers get a smaller region of definition. The display window is not changed."
+#define kWriteEXRPreviewParamName "writePreview"
+#define kWriteEXRPreviewParamLabel "Write Preview"
+#define kWriteEXRPreviewParamHint "Store an 8-bit preview of the image in the file header. Readers can display it (e.g. as a thumbnail) without decoding the pixels."
+#define kWriteEXRPreviewWidthParamName "previewWidth"
+#define kWriteEXRPreviewWidthParamLabel "Preview Width"
+#define kWriteEXRPreviewWidthParamHint "Maximum width of the preview, in pixels. Its height is computed from the aspect ratio of the data window."
+#define kWriteEXREncodeStatsParamName "encodeStats"
+#define kWriteEXREncodeStatsParamLabel "Encode Stats..."
+#define kWriteEXREncodeStatsParamHint "Display the encoding time and the file size of the frames written since the output file was set, to compare compressions."
+#define kWriteEXRTileSizeParamName "tileSize"
+#define kWriteEXRTileSizeParamLabel "Tiles"
+#define kWriteEXRTileSizeParamHint "Write a scan line file, or a tiled file with the given tile size. Tiled files let readers decode only the tiles they need."
+#define kWriteEXRLevelModeParamName "levelMode"
+#define kWriteEXRLevelModeParamLabel "Levels"
+#define kWriteEXRLevelModeParamHint "Levels of detail written in tiled files: full resolution only, mipmap levels (halving both dimensions), or ripmap levels (halving each dimension independently). Readers can then decode proxy render scales from a level without reading the full resolution image. Ignored for scan line files."
 
 #ifndef OPENEXR_IMF_NAMESPACE
 #define OPENEXR_IMF_NAMESPACE Imf
 #endif
 
+#if OPENEXR_VERSION_MAJOR > 2 || (OPENEXR_VERSION_MAJOR == 2 && OPENEXR_VERSION_MINOR >= 2)
+#define OFX_IO_EXR_HAS_DWA // DWAA and DWAB compressions
+#endif
+#if OPENEXR_VERSION_MAJOR > 3 || (OPENEXR_VERSION_MAJOR == 3 && OPENEXR_VERSION_MINOR >= 1)
+#define OFX_IO_EXR_HAS_ZIP_LEVEL // Header::zipCompressionLevel()
+#endif
+
 #define kSupportsRGBA true
 #define kSupportsRGB true
 #define kSupportsAlpha true
@@ -75,15 +126,20 @@ namespace Imf_ = OPENEXR_IMF_NAMESPACE;
 
 namespace Exr {
     
-    static std::string const compressionNames[6]={
+    static std::string const compressionNames[10]={
         "No compression",
         "Zip (1 scanline)",
         "Zip (16 scanlines)",
         "PIZ Wavelet (32 scanlines)",
         "RLE",
-        "B44"
+        "B44",
+        "PXR24 (lossy, 16 scanlines)",
+        "B44A",
+        "DWAA (lossy, 32 scanlines)",
+        "DWAB (lossy, 256 scanlines)"
     };
     
+    // returns NUM_COMPRESSION_METHODS if the compression is not supported by this version of OpenEXR
     static Imf_::Compression stringToCompression(const std::string& str){
         if(str == compressionNames[0]){
             return Imf_::NO_COMPRESSION;
@@ -95,11 +151,65 @@ namespace Exr {
             return Imf_::PIZ_COMPRESSION;
         }else if(str == compressionNames[4]){
             return Imf_::RLE_COMPRESSION;
+        }else if(str == compressionNames[6]){
+            return Imf_::PXR24_COMPRESSION;
+        }else if(str == compressionNames[7]){
+            return Imf_::B44A_COMPRESSION;
+        }else if(str == compressionNames[8]){
+#ifdef OFX_IO_EXR_HAS_DWA
+            return Imf_::DWAA_COMPRESSION;
+#else
+            return Imf_::NUM_COMPRESSION_METHODS;
+#endif
+        }else if(str == compressionNames[9]){
+#ifdef OFX_IO_EXR_HAS_DWA
+            return Imf_::DWAB_COMPRESSION;
+#else
+            return Imf_::NUM_COMPRESSION_METHODS;
+#endif
         }else{
             return Imf_::B44_COMPRESSION;
         }
     }
     
+    static bool isZipCompression(Imf_::Compression compression){
+        return compression == Imf_::ZIPS_COMPRESSION || compression == Imf_::ZIP_COMPRESSION;
+    }
+    
+    static bool isDwaCompression(Imf_::Compression compression){
+#ifdef OFX_IO_EXR_HAS_DWA
+        return compression == Imf_::DWAA_COMPRESSION || compression == Imf_::DWAB_COMPRESSION;
+#else
+        (void)compression;
+        return false;
+#endif
+    }
+    
+    // wall clock time in seconds, to measure encoding times
+    static double getTimeSeconds()
+    {
+#ifdef _WIN32
+        LARGE_INTEGER frequency, counter;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&counter);
+        return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+    }
+    
+    static long long getFileSize(const std::string& filename)
+    {
+        std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+        if (!file) {
+            return -1;
+        }
+        return (long long)file.tellg();
+    }
+
+    
     static  std::string const depthNames[2] = {
         "16 bit half", "32 bit float"
     };
@@ -112,6 +222,346 @@ namespace Exr {
         }
     }
     
+    static std::string const tileSizeNames[5] = {
+        "Scan lines", "32x32 tiles", "64x64 tiles", "128x128 tiles", "256x256 tiles"
+    };
+    
+    static int tileSizeNameToInt(const std::string& name){
+        if(name == tileSizeNames[1]){
+            return 32;
+        }else if(name == tileSizeNames[2]){
+            return 64;
+        }else if(name == tileSizeNames[3]){
+            return 128;
+        }else if(name == tileSizeNames[4]){
+            return 256;
+        }else{
+            return 0;
+        }
+    }
+    
+    static std::string const levelModeNames[3] = {
+        "One level", "Mipmap", "Ripmap"
+    };
+    
+    static Imf_::LevelMode stringToLevelMode(const std::string& str){
+        if(str == levelModeNames[1]){
+            return Imf_::MIPMAP_LEVELS;
+        }else if(str == levelModeNames[2]){
+            return Imf_::RIPMAP_LEVELS;
+        }else{
+            return Imf_::ONE_LEVEL;
+        }
+    }
+    
+    // convert n floats to halfs
+    static void floatToHalf(const float* src, size_t n, half* dst)
+    {
+        size_t i = 0;
+#if defined(__F16C__) && defined(__AVX__)
+        for (; i + 8 <= n; i += 8) {
+            __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+            _mm_storeu_si128((__m128i*)(dst + i), h);
+        }
+#endif
+        for (; i < n; ++i) {
+            dst[i] = src[i];
+        }
+    }
+    
+    // Insert in fbuf the slices of an image of numChannels interleaved floats, stored in the file
+    // line order (topLine is line y0 of the file, and lines are lineStride bytes apart), whose
+    // top-left pixel is at (x0,y0) in the file. For half files, the image is converted to halfPixels.
+    static void insertSlices(Imf_::FrameBuffer* fbuf,
+                             const char* const chanNames[],
+                             int numChannels,
+                             Imf_::PixelType pixelType,
+                             const float* topLine,
+                             ptrdiff_t lineStride,
+                             int x0,
+                             int y0,
+                             int width,
+                             int height,
+                             std::vector<half>* halfPixels)
+    {
+        if (pixelType == Imf_::FLOAT) {
+            const size_t pixelStride = sizeof(float) * numChannels;
+            const char* origin = (const char*)topLine - (ptrdiff_t)x0 * (ptrdiff_t)pixelStride - (ptrdiff_t)y0 * lineStride;
+            for (int chan = 0; chan < numChannels; ++chan) {
+                fbuf->insert(chanNames[chan], Imf_::Slice(Imf_::FLOAT, (char*)origin + chan * sizeof(float), pixelStride, lineStride));
+            }
+        } else {
+            // convert the image to half in one pass
+            const size_t lineSize = (size_t)width * numChannels;
+            halfPixels->resize(lineSize * height);
+            for (int line = 0; line < height; ++line) {
+                floatToHalf((const float*)((const char*)topLine + line * lineStride), lineSize, &(*halfPixels)[line * lineSize]);
+            }
+            const size_t pixelStride = sizeof(half) * numChannels;
+            const size_t halfLineStride = pixelStride * width;
+            char* origin = (char*)&(*halfPixels)[0] - (ptrdiff_t)x0 * (ptrdiff_t)pixelStride - (ptrdiff_t)y0 * (ptrdiff_t)halfLineStride;
+            for (int chan = 0; chan < numChannels; ++chan) {
+                fbuf->insert(chanNames[chan], Imf_::Slice(Imf_::HALF, origin + chan * sizeof(half), pixelStride, halfLineStride));
+            }
+        }
+    }
+    
+    // Halve an image of interleaved floats horizontally and/or vertically with a box filter. The
+    // sizes are rounded down (but never below 1) like the ROUND_DOWN levels of OpenEXR, so that
+    // each level can be computed from the previous one. The lines are computed in parallel.
+    class Downsampler : public OFX::MultiThread::Processor
+    {
+    public:
+        Downsampler(const float* src,
+                    ptrdiff_t srcLineStride,
+                    int srcWidth,
+                    int srcHeight,
+                    int numChannels,
+                    bool halveX,
+                    bool halveY,
+                    std::vector<float>* dst)
+        : _src(src)
+        , _srcLineStride(srcLineStride)
+        , _srcWidth(srcWidth)
+        , _srcHeight(srcHeight)
+        , _numChannels(numChannels)
+        , _halveX(halveX)
+        , _halveY(halveY)
+        , _dstWidth(halveX ? std::max(1, srcWidth / 2) : srcWidth)
+        , _dstHeight(halveY ? std::max(1, srcHeight / 2) : srcHeight)
+        , _dst(dst)
+        {
+            _dst->resize((size_t)_dstWidth * _dstHeight * _numChannels);
+        }
+        
+        void process() { multiThread(std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)_dstHeight)); }
+        
+        int dstWidth() const { return _dstWidth; }
+        
+        int dstHeight() const { return _dstHeight; }
+        
+        ptrdiff_t dstLineStride() const { return (ptrdiff_t)_dstWidth * _numChannels * sizeof(float); }
+        
+    private:
+        virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+        {
+            const int y1 = (int)(((long long)_dstHeight * threadId) / nThreads);
+            const int y2 = (int)(((long long)_dstHeight * (threadId + 1)) / nThreads);
+            for (int y = y1; y < y2; ++y) {
+                const int sy0 = _halveY ? 2 * y : y;
+                const int sy1 = _halveY ? std::min(2 * y + 1, _srcHeight - 1) : sy0;
+                const float* line0 = (const float*)((const char*)_src + sy0 * _srcLineStride);
+                const float* line1 = (const float*)((const char*)_src + sy1 * _srcLineStride);
+                float* dst = &(*_dst)[(size_t)y * _dstWidth * _numChannels];
+                for (int x = 0; x < _dstWidth; ++x) {
+                    const int sx0 = (_halveX ? 2 * x : x) * _numChannels;
+                    const int sx1 = (_halveX ? std::min(2 * x + 1, _srcWidth - 1) : x) * _numChannels;
+                    for (int c = 0; c < _numChannels; ++c, ++dst) {
+                        *dst = 0.25f * (line0[sx0 + c] + line0[sx1 + c] + line1[sx0 + c] + line1[sx1 + c]);
+                    }
+                }
+            }
+        }
+        
+        const float* _src;
+        ptrdiff_t _srcLineStride;
+        int _srcWidth;
+        int _srcHeight;
+        int _numChannels;
+        bool _halveX;
+        bool _halveY;
+        int _dstWidth;
+        int _dstHeight;
+        std::vector<float>* _dst;
+    };
+    
+    // convert a linear value to an 8-bit preview value
+    static unsigned char previewEncode(float v, bool gamma)
+    {
+        if (!(v > 0.f)) {
+            return 0;
+        } else if (v >= 1.f) {
+            return 255;
+        }
+        return (unsigned char)((gamma ? std::pow(v, 1.f / 2.2f) : v) * 255.f + 0.5f);
+    }
+    
+    // Compute the 8-bit preview of an image of interleaved floats, stored in the file line order.
+    // Each preview pixel is the average of the image pixels it covers, encoded with a 2.2 gamma
+    // like the previews made by the OpenEXR tools.
+    static Imf_::PreviewImage makePreview(const float* topLine,
+                                          ptrdiff_t lineStride,
+                                          int width,
+                                          int height,
+                                          int numChannels,
+                                          int maxPreviewWidth)
+    {
+        const int previewWidth = std::max(1, std::min(maxPreviewWidth, width));
+        const int previewHeight = std::max(1, (int)((long long)height * previewWidth / width));
+        std::vector<float> sums((size_t)previewWidth * previewHeight * 4, 0.f);
+        std::vector<int> counts((size_t)previewWidth * previewHeight, 0);
+        std::vector<int> previewX(width);
+        for (int x = 0; x < width; ++x) {
+            previewX[x] = (int)((long long)x * previewWidth / width);
+        }
+        for (int y = 0; y < height; ++y) {
+            const float* src = (const float*)((const char*)topLine + y * lineStride);
+            const size_t previewLine = (size_t)((long long)y * previewHeight / height) * previewWidth;
+            for (int x = 0; x < width; ++x, src += numChannels) {
+                const size_t p = previewLine + previewX[x];
+                float* sum = &sums[p * 4];
+                if (numChannels == 1) {
+                    sum[0] += src[0];
+                    sum[1] += src[0];
+                    sum[2] += src[0];
+                    sum[3] += src[0];
+                } else {
+                    sum[0] += src[0];
+                    sum[1] += src[1];
+                    sum[2] += src[2];
+                    sum[3] += (numChannels == 4) ? src[3] : 1.f;
+                }
+                ++counts[p];
+            }
+        }
+        Imf_::PreviewImage preview(previewWidth, previewHeight);
+        for (int y = 0; y < previewHeight; ++y) {
+            for (int x = 0; x < previewWidth; ++x) {
+                const size_t p = (size_t)y * previewWidth + x;
+                const float norm = counts[p] ? 1.f / counts[p] : 0.f;
+                Imf_::PreviewRgba& rgba = preview.pixel(x, y);
+                rgba.r = previewEncode(sums[p * 4] * norm, true);
+                rgba.g = previewEncode(sums[p * 4 + 1] * norm, true);
+                rgba.b = previewEncode(sums[p * 4 + 2] * norm, true);
+                rgba.a = previewEncode(sums[p * 4 + 3] * norm, false);
+            }
+        }
+        return preview;
+    }
+    
+    // Find the bounding box of the pixels which have at least one non-zero channel. The rows are
+    // scanned in parallel, from both ends, by blocks of values that the compiler can vectorize.
+    class NonZeroBoundsFinder : public OFX::MultiThread::Processor
+    {
+    public:
+        NonZeroBoundsFinder(const float* pixelData,
+                            const OfxRectI& bounds,
+                            int numChannels,
+                            int rowBytes)
+        : _pixelData(pixelData)
+        , _bounds(bounds)
+        , _numChannels(numChannels)
+        , _rowBytes(rowBytes)
+        , _threadBounds()
+        {
+        }
+        
+        /// returns false if all the pixels are zero
+        bool process(OfxRectI* nonZeroBounds)
+        {
+            const unsigned int nThreads = std::max(1u, std::min(OFX::MultiThread::getNumCPUs(), (unsigned int)(_bounds.y2 - _bounds.y1)));
+            OfxRectI empty;
+            empty.x1 = _bounds.x2;
+            empty.y1 = _bounds.y2;
+            empty.x2 = _bounds.x1;
+            empty.y2 = _bounds.y1;
+            _threadBounds.assign(nThreads, empty);
+            multiThread(nThreads);
+            *nonZeroBounds = empty;
+            for (std::vector<OfxRectI>::const_iterator it = _threadBounds.begin(); it != _threadBounds.end(); ++it) {
+                nonZeroBounds->x1 = std::min(nonZeroBounds->x1, it->x1);
+                nonZeroBounds->y1 = std::min(nonZeroBounds->y1, it->y1);
+                nonZeroBounds->x2 = std::max(nonZeroBounds->x2, it->x2);
+                nonZeroBounds->y2 = std::max(nonZeroBounds->y2, it->y2);
+            }
+            return nonZeroBounds->x1 < nonZeroBounds->x2 && nonZeroBounds->y1 < nonZeroBounds->y2;
+        }
+        
+    private:
+        enum { kBlockSize = 16 };
+        
+        static bool isBlockZero(const float* p)
+        {
+            int nonZero = 0;
+            for (int i = 0; i < kBlockSize; ++i) {
+                nonZero |= (p[i] != 0.f);
+            }
+            return !nonZero;
+        }
+        
+        // index of the first non-zero value, or n
+        static int firstNonZero(const float* p, int n)
+        {
+            int i = 0;
+            while (i + kBlockSize <= n && isBlockZero(p + i)) {
+                i += kBlockSize;
+            }
+            while (i < n && p[i] == 0.f) {
+                ++i;
+            }
+            return i;
+        }
+        
+        // index of the last non-zero value, p must contain at least one
+        static int lastNonZero(const float* p, int n)
+        {
+            int i = n;
+            while (i - kBlockSize >= 0 && isBlockZero(p + i - kBlockSize)) {
+                i -= kBlockSize;
+            }
+            do {
+                --i;
+            } while (p[i] == 0.f);
+            return i;
+        }
+        
+        virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+        {
+            const int height = _bounds.y2 - _bounds.y1;
+            const int y1 = _bounds.y1 + (int)(((long long)height * threadId) / nThreads);
+            const int y2 = _bounds.y1 + (int)(((long long)height * (threadId + 1)) / nThreads);
+            const int n = (_bounds.x2 - _bounds.x1) * _numChannels;
+            OfxRectI& r = _threadBounds[threadId];
+            for (int y = y1; y < y2; ++y) {
+                const float* line = (const float*)((const char*)_pixelData + (ptrdiff_t)(y - _bounds.y1) * _rowBytes);
+                const int first = firstNonZero(line, n);
+                if (first == n) {
+                    continue;
+                }
+                const int last = lastNonZero(line, n);
+                r.x1 = std::min(r.x1, _bounds.x1 + first / _numChannels);
+                r.x2 = std::max(r.x2, _bounds.x1 + last / _numChannels + 1);
+                r.y1 = std::min(r.y1, y);
+                r.y2 = std::max(r.y2, y + 1);
+            }
+        }
+        
+        const float* _pixelData;
+        OfxRectI _bounds;
+        int _numChannels;
+        int _rowBytes;
+        std::vector<OfxRectI> _threadBounds;
+    };
+    
+    // write all the tiles of level (lx,ly), given in the file line order
+    static void writeTiledLevel(Imf_::TiledOutputFile& outputFile,
+                                const char* const chanNames[],
+                                int numChannels,
+                                Imf_::PixelType pixelType,
+                                const float* topLine,
+                                ptrdiff_t lineStride,
+                                int lx,
+                                int ly,
+                                std::vector<half>* halfPixels)
+    {
+        const Imath::Box2i levelwin = outputFile.dataWindowForLevel(lx, ly);
+        Imf_::FrameBuffer fbuf;
+        insertSlices(&fbuf, chanNames, numChannels, pixelType, topLine, lineStride, levelwin.min.x, levelwin.min.y,
+                     levelwin.max.x - levelwin.min.x + 1, levelwin.max.y - levelwin.min.y + 1, halfPixels);
+        outputFile.setFrameBuffer(fbuf);
+        outputFile.writeTiles(0, outputFile.numXTiles(lx) - 1, 0, outputFile.numYTiles(ly) - 1, lx, ly);
+    }
+    
     
 }
 
@@ -124,18 +574,40 @@ public:
 
     virtual ~WriteEXRPlugin();
 
-    //virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName);
+    virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
 private:
 
+    struct FrameStats {
+        double encodeSeconds;
+        long long fileBytes; ///< -1 if unknown
+        long long pixelBytes; ///< size of the uncompressed pixels
+    };
+
     virtual void encode(const std::string& filename, OfxTime time, const float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int rowBytes) OVERRIDE FINAL;
 
     virtual bool isImageFile(const std::string& fileExtension) const OVERRIDE FINAL;
 
     virtual OFX::PreMultiplicationEnum getExpectedInputPremultiplication() const { return OFX::eImagePreMultiplied; }
 
+    virtual void onOutputFileChanged(const std::string& newFile) OVERRIDE FINAL;
+
+    void updateCompressionLevelParams();
+
+    std::string getEncodeStats();
+
     OFX::ChoiceParam* _compression;
     OFX::ChoiceParam* _bitDepth;
+    OFX::ChoiceParam* _tileSize;
+    OFX::ChoiceParam* _levelMode;
+    OFX::IntParam* _zipLevel;
+    OFX::DoubleParam* _dwaLevel;
+    OFX::BooleanParam* _autoCrop;
+    OFX::BooleanParam* _preview;
+    OFX::IntParam* _previewWidth;
+
+    OFX::MultiThread::Mutex _statsLock;
+    std::map<OfxTime, FrameStats> _stats; ///< encoding stats of the frames written to the current output file
     
 };
 
@@ -143,22 +615,105 @@ WriteEXRPlugin::WriteEXRPlugin(OfxImageEffectHandle handle)
 : GenericWriterPlugin(handle)
 , _compression(0)
 , _bitDepth(0)
+, _tileSize(0)
+, _levelMode(0)
+, _zipLevel(0)
+, _dwaLevel(0)
+, _autoCrop(0)
+, _preview(0)
+, _previewWidth(0)
+, _statsLock()
+, _stats()
 {
     _compression = fetchChoiceParam(kWriteEXRCompressionParamName);
     _bitDepth = fetchChoiceParam(kWriteEXRDataTypeParamName);
+    _tileSize = fetchChoiceParam(kWriteEXRTileSizeParamName);
+    _levelMode = fetchChoiceParam(kWriteEXRLevelModeParamName);
+    _zipLevel = fetchIntParam(kWriteEXRZipLevelParamName);
+    _dwaLevel = fetchDoubleParam(kWriteEXRDwaLevelParamName);
+    _autoCrop = fetchBooleanParam(kWriteEXRAutoCropParamName);
+    _preview = fetchBooleanParam(kWriteEXRPreviewParamName);
+    _previewWidth = fetchIntParam(kWriteEXRPreviewWidthParamName);
+    updateCompressionLevelParams();
+    bool preview;
+    _preview->getValue(preview);
+    _previewWidth->setEnabled(preview);
 }
 
 WriteEXRPlugin::~WriteEXRPlugin(){
     
 }
 
-//void WriteEXRPlugin::changedParam(const OFX::InstanceChangedArgs &/*args*/, const std::string &paramName)
-//{
-//}
+void WriteEXRPlugin::changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName)
+{
+    if (paramName == kWriteEXRCompressionParamName) {
+        updateCompressionLevelParams();
+    } else if (paramName == kWriteEXRPreviewParamName) {
+        bool preview;
+        _preview->getValue(preview);
+        _previewWidth->setEnabled(preview);
+    } else if (paramName == kWriteEXREncodeStatsParamName && args.reason == OFX::eChangeUserEdit) {
+        sendMessage(OFX::Message::eMessageMessage, "", getEncodeStats());
+    }
+    GenericWriterPlugin::changedParam(args, paramName);
+}
+
+void WriteEXRPlugin::onOutputFileChanged(const std::string& /*newFile*/)
+{
+    OFX::MultiThread::AutoMutex lock(_statsLock);
+    _stats.clear();
+}
+
+// only enable the compression level of the selected compression
+void WriteEXRPlugin::updateCompressionLevelParams()
+{
+    int compressionIndex;
+    _compression->getValue(compressionIndex);
+    Imf_::Compression compression = Exr::stringToCompression(Exr::compressionNames[compressionIndex]);
+#ifdef OFX_IO_EXR_HAS_ZIP_LEVEL
+    _zipLevel->setEnabled(Exr::isZipCompression(compression));
+#else
+    _zipLevel->setEnabled(false);
+#endif
+    _dwaLevel->setEnabled(Exr::isDwaCompression(compression));
+}
+
+std::string WriteEXRPlugin::getEncodeStats()
+{
+    OFX::MultiThread::AutoMutex lock(_statsLock);
+    if (_stats.empty()) {
+        return "No frame was written to the output file yet.";
+    }
+    std::ostringstream msg;
+    msg.setf(std::ios::fixed);
+    msg.precision(3);
+    double totalSeconds = 0.;
+    long long totalFileBytes = 0;
+    long long totalPixelBytes = 0;
+    for (std::map<OfxTime, FrameStats>::const_iterator it = _stats.begin(); it != _stats.end(); ++it) {
+        msg << "Frame " << it->first << ": " << it->second.encodeSeconds << " s";
+        if (it->second.fileBytes >= 0) {
+            msg << ", " << it->second.fileBytes / (1024. * 1024.) << " MB";
+            if (it->second.fileBytes > 0) {
+                msg << " (ratio " << (double)it->second.pixelBytes / it->second.fileBytes << ")";
+            }
+            totalFileBytes += it->second.fileBytes;
+            totalPixelBytes += it->second.pixelBytes;
+        }
+        msg << "\n";
+        totalSeconds += it->second.encodeSeconds;
+    }
+    msg << "Total: " << _stats.size() << " frames, " << totalSeconds << " s, " << totalFileBytes / (1024. * 1024.) << " MB";
+    if (totalSeconds > 0.) {
+        msg << ", " << totalPixelBytes / (1024. * 1024.) / totalSeconds << " MB/s uncompressed";
+    }
+    msg << "\n";
+    return msg.str();
+}
 
 
 void WriteEXRPlugin::encode(const std::string& filename,
-                            OfxTime /*time*/,
+                            OfxTime time,
                             const float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int rowBytes)
 {
     if (pixelComponents != OFX::ePixelComponentRGBA && pixelComponents != OFX::ePixelComponentRGB && pixelComponents != OFX::ePixelComponentAlpha) {
@@ -186,17 +741,45 @@ void WriteEXRPlugin::encode(const std::string& filename,
         _compression->getValue(compressionIndex);
         
         Imf_::Compression compression(Exr::stringToCompression(Exr::compressionNames[compressionIndex]));
+        if (compression == Imf_::NUM_COMPRESSION_METHODS) {
+            throw std::runtime_error(Exr::compressionNames[compressionIndex] + " requires a more recent version of OpenEXR");
+        }
         
         int depthIndex;
         _bitDepth->getValue(depthIndex);
         
         int depth = Exr::depthNameToInt(Exr::depthNames[depthIndex]);
+        
+        int tileSizeIndex;
+        _tileSize->getValue(tileSizeIndex);
+        
+        int tileSize = Exr::tileSizeNameToInt(Exr::tileSizeNames[tileSizeIndex]);
+        
+        int levelModeIndex;
+        _levelMode->getValue(levelModeIndex);
+        
+        Imf_::LevelMode levelMode(Exr::stringToLevelMode(Exr::levelModeNames[levelModeIndex]));
+        
+        // the part of the image written to the file
+        OfxRectI dataBounds = bounds;
+        bool autoCrop;
+        _autoCrop->getValue(autoCrop);
+        if (autoCrop && !Exr::NonZeroBoundsFinder(pixelData, bounds, numChannels, rowBytes).process(&dataBounds)) {
+            // an OpenEXR data window cannot be empty: write a single black pixel
+            dataBounds.x1 = bounds.x1;
+            dataBounds.x2 = bounds.x1 + 1;
+            dataBounds.y1 = bounds.y2 - 1;
+            dataBounds.y2 = bounds.y2;
+        }
+        
+        // OpenEXR lines go from top to bottom, OpenFX rows from bottom to top: line y of the file
+        // is row (bounds.y2 - 1 - (y - bounds.y1)) of the image.
         Imath::Box2i exrDataW;
 
-        exrDataW.min.x = bounds.x1;
-        exrDataW.min.y = bounds.y1;
-        exrDataW.max.x = bounds.x2 - 1;
-        exrDataW.max.y = bounds.y2 - 1;
+        exrDataW.min.x = dataBounds.x1;
+        exrDataW.min.y = bounds.y1 + (bounds.y2 - dataBounds.y2);
+        exrDataW.max.x = dataBounds.x2 - 1;
+        exrDataW.max.y = bounds.y1 + (bounds.y2 - 1 - dataBounds.y1);
         
         Imath::Box2i exrDispW;
         exrDispW.min.x = 0;
@@ -206,6 +789,20 @@ void WriteEXRPlugin::encode(const std::string& filename,
 
         Imf_::Header exrheader(exrDispW, exrDataW, 1.,
                                Imath::V2f(0, 0), 1, Imf_::INCREASING_Y, compression);
+#ifdef OFX_IO_EXR_HAS_ZIP_LEVEL
+        if (Exr::isZipCompression(compression)) {
+            int zipLevel;
+            _zipLevel->getValue(zipLevel);
+            exrheader.zipCompressionLevel() = zipLevel;
+        }
+#endif
+#ifdef OFX_IO_EXR_HAS_DWA
+        if (Exr::isDwaCompression(compression)) {
+            double dwaLevel;
+            _dwaLevel->getValue(dwaLevel);
+            Imf_::addDwaCompressionLevel(exrheader, (float)dwaLevel);
+        }
+#endif
         
         Imf_::PixelType pixelType;
         if (depth == 32) {
@@ -223,41 +820,91 @@ void WriteEXRPlugin::encode(const std::string& filename,
             exrheader.channels().insert(chanNames[chan],Imf_::Channel(pixelType));
         }
 
-        Imf_::OutputFile outputFile(filename.c_str(),exrheader);
-        
-        for (int y = bounds.y1; y < bounds.y2; ++y) {
-            /*First we create a row that will serve as the output buffer.
-             We copy the scan-line (with y inverted) in the inputImage to the row.*/
-            int exrY = bounds.y2 - y - 1;
-            
-            float* src_pixels = (float*)((char*)pixelData + (exrY - bounds.y1)*rowBytes);
-            
-            /*we create the frame buffer*/
+        const int width = dataBounds.x2 - dataBounds.x1;
+        const int height = dataBounds.y2 - dataBounds.y1;
+        const float* topLine = (const float*)((const char*)pixelData + (ptrdiff_t)(dataBounds.y2 - 1 - bounds.y1) * rowBytes) + (dataBounds.x1 - bounds.x1) * numChannels;
+        std::vector<half> halfPixels;
+        const double startTime = Exr::getTimeSeconds();
+
+        bool preview;
+        _preview->getValue(preview);
+        if (preview) {
+            int previewWidth;
+            _previewWidth->getValue(previewWidth);
+            exrheader.setPreviewImage(Exr::makePreview(topLine, -(ptrdiff_t)rowBytes, width, height, numChannels, previewWidth));
+        }
+
+        if (tileSize == 0) {
+            // The whole frame is written with a single writePixels() call, so that OpenEXR can compress
+            // several line blocks in parallel.
+            Imf_::OutputFile outputFile(filename.c_str(),exrheader);
             Imf_::FrameBuffer fbuf;
-            if (depth == 32) {
-                for (int chan = 0; chan < numChannels; ++chan) {
-                    fbuf.insert(chanNames[chan],Imf_::Slice(Imf_::FLOAT, (char*)src_pixels + chan, sizeof(float) * numChannels, 0));
+            Exr::insertSlices(&fbuf, chanNames, numChannels, pixelType, topLine, -(ptrdiff_t)rowBytes,
+                              exrDataW.min.x, exrDataW.min.y, width, height, &halfPixels);
+            outputFile.setFrameBuffer(fbuf);
+            outputFile.writePixels(height);
+        } else {
+            exrheader.setTileDescription(Imf_::TileDescription(tileSize, tileSize, levelMode, Imf_::ROUND_DOWN));
+            Imf_::TiledOutputFile outputFile(filename.c_str(),exrheader);
+            Exr::writeTiledLevel(outputFile, chanNames, numChannels, pixelType, topLine, -(ptrdiff_t)rowBytes, 0, 0, &halfPixels);
+
+            // each level is computed from the previous one
+            if (levelMode == Imf_::MIPMAP_LEVELS) {
+                std::vector<float> levels[2];
+                const float* src = topLine;
+                ptrdiff_t srcLineStride = -(ptrdiff_t)rowBytes;
+                int w = width;
+                int h = height;
+                for (int l = 1; l < outputFile.numLevels(); ++l) {
+                    Exr::Downsampler downsampler(src, srcLineStride, w, h, numChannels, true, true, &levels[l & 1]);
+                    downsampler.process();
+                    src = &levels[l & 1][0];
+                    srcLineStride = downsampler.dstLineStride();
+                    w = downsampler.dstWidth();
+                    h = downsampler.dstHeight();
+                    Exr::writeTiledLevel(outputFile, chanNames, numChannels, pixelType, src, srcLineStride, l, l, &halfPixels);
                 }
-            } else {
-                Imf_::Array2D<half> halfwriterow(numChannels ,bounds.x2 - bounds.x1);
-                
-                for (int chan = 0; chan < numChannels; ++chan) {
-                    fbuf.insert(chanNames[chan],
-                                Imf_::Slice(Imf_::HALF,
-                                            (char*)(&halfwriterow[chan][0] - exrDataW.min.x),
-                                            sizeof(halfwriterow[chan][0]), 0));
-                    const float* from = src_pixels + chan;
-                    for (int i = exrDataW.min.x,f = exrDataW.min.x; i < exrDataW.max.x ; ++i, f += numChannels) {
-                        halfwriterow[chan][i - exrDataW.min.x] = from[f];
+            } else if (levelMode == Imf_::RIPMAP_LEVELS) {
+                // levels (0,ly) are computed from (0,ly-1), and levels (lx,ly) from (lx-1,ly)
+                std::vector<float> columnLevels[2];
+                std::vector<float> rowLevels[2];
+                const float* columnSrc = topLine;
+                ptrdiff_t columnLineStride = -(ptrdiff_t)rowBytes;
+                int h = height;
+                for (int ly = 0; ly < outputFile.numYLevels(); ++ly) {
+                    if (ly > 0) {
+                        Exr::Downsampler downsampler(columnSrc, columnLineStride, width, h, numChannels, false, true, &columnLevels[ly & 1]);
+                        downsampler.process();
+                        columnSrc = &columnLevels[ly & 1][0];
+                        columnLineStride = downsampler.dstLineStride();
+                        h = downsampler.dstHeight();
+                        Exr::writeTiledLevel(outputFile, chanNames, numChannels, pixelType, columnSrc, columnLineStride, 0, ly, &halfPixels);
+                    }
+                    const float* src = columnSrc;
+                    ptrdiff_t srcLineStride = columnLineStride;
+                    int w = width;
+                    for (int lx = 1; lx < outputFile.numXLevels(); ++lx) {
+                        Exr::Downsampler downsampler(src, srcLineStride, w, h, numChannels, true, false, &rowLevels[lx & 1]);
+                        downsampler.process();
+                        src = &rowLevels[lx & 1][0];
+                        srcLineStride = downsampler.dstLineStride();
+                        w = downsampler.dstWidth();
+                        Exr::writeTiledLevel(outputFile, chanNames, numChannels, pixelType, src, srcLineStride, lx, ly, &halfPixels);
                     }
                 }
             }
-            outputFile.setFrameBuffer(fbuf);
-            outputFile.writePixels(1);
         }
 
-        
-        
+        // the output file is closed: record the encoding time and the file size
+        FrameStats stats;
+        stats.encodeSeconds = Exr::getTimeSeconds() - startTime;
+        stats.fileBytes = Exr::getFileSize(filename);
+        stats.pixelBytes = (long long)width * height * numChannels * (depth / 8);
+        {
+            OFX::MultiThread::AutoMutex lock(_statsLock);
+            _stats[time] = stats;
+        }
+
     } catch (const std::exception& e) {
         setPersistentMessage(OFX::Message::eMessageError, "",std::string("OpenEXR error") + ": " + e.what());
         OFX::throwSuiteStatusException(kOfxStatFailed);
@@ -271,7 +918,7 @@ bool WriteEXRPlugin::isImageFile(const std::string& /*fileExtension*/) const{
 
 using namespace OFX;
 
-mDeclareWriterPluginFactory(WriteEXRPluginFactory, {}, {}, false);
+mDeclareWriterPluginFactory(WriteEXRPluginFactory, { Exr::setGlobalThreadCount(); }, {}, false);
 
 
 /** @brief The basic describe function, passed a plugin descriptor */
@@ -301,13 +948,37 @@ void WriteEXRPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
     {
         OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam(kWriteEXRCompressionParamName);
         param->setAnimates(true);
-        for (int i =0; i < 6; ++i) {
+        for (int i =0; i < 10; ++i) {
             param->appendOption(Exr::compressionNames[i]);
         }
         param->setDefault(3);
         page->addChild(*param);
     }
 
+    ////////Zip compression level
+    {
+        OFX::IntParamDescriptor* param = desc.defineIntParam(kWriteEXRZipLevelParamName);
+        param->setLabels(kWriteEXRZipLevelParamLabel, kWriteEXRZipLevelParamLabel, kWriteEXRZipLevelParamLabel);
+        param->setHint(kWriteEXRZipLevelParamHint);
+        param->setRange(1, 9);
+        param->setDisplayRange(1, 9);
+        param->setDefault(4);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
+    ////////DWA compression level
+    {
+        OFX::DoubleParamDescriptor* param = desc.defineDoubleParam(kWriteEXRDwaLevelParamName);
+        param->setLabels(kWriteEXRDwaLevelParamLabel, kWriteEXRDwaLevelParamLabel, kWriteEXRDwaLevelParamLabel);
+        param->setHint(kWriteEXRDwaLevelParamHint);
+        param->setRange(0., DBL_MAX);
+        param->setDisplayRange(0., 200.);
+        param->setDefault(45.);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
     ////////Data type
     {
         OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam(kWriteEXRDataTypeParamName);
@@ -319,6 +990,70 @@ void WriteEXRPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
         page->addChild(*param);
     }
 
+    ////////Tiles
+    {
+        OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam(kWriteEXRTileSizeParamName);
+        param->setLabels(kWriteEXRTileSizeParamLabel, kWriteEXRTileSizeParamLabel, kWriteEXRTileSizeParamLabel);
+        param->setHint(kWriteEXRTileSizeParamHint);
+        param->setAnimates(true);
+        for(int i = 0 ; i < 5 ; ++i) {
+            param->appendOption(Exr::tileSizeNames[i]);
+        }
+        param->setDefault(0);
+        page->addChild(*param);
+    }
+
+    ////////Levels
+    {
+        OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam(kWriteEXRLevelModeParamName);
+        param->setLabels(kWriteEXRLevelModeParamLabel, kWriteEXRLevelModeParamLabel, kWriteEXRLevelModeParamLabel);
+        param->setHint(kWriteEXRLevelModeParamHint);
+        param->setAnimates(true);
+        for(int i = 0 ; i < 3 ; ++i) {
+            param->appendOption(Exr::levelModeNames[i]);
+        }
+        param->setDefault(0);
+        page->addChild(*param);
+    }
+
+    ////////Auto crop
+    {
+        OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kWriteEXRAutoCropParamName);
+        param->setLabels(kWriteEXRAutoCropParamLabel, kWriteEXRAutoCropParamLabel, kWriteEXRAutoCropParamLabel);
+        param->setHint(kWriteEXRAutoCropParamHint);
+        param->setDefault(false);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
+    ////////Preview
+    {
+        OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kWriteEXRPreviewParamName);
+        param->setLabels(kWriteEXRPreviewParamLabel, kWriteEXRPreviewParamLabel, kWriteEXRPreviewParamLabel);
+        param->setHint(kWriteEXRPreviewParamHint);
+        param->setDefault(false);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+    {
+        OFX::IntParamDescriptor* param = desc.defineIntParam(kWriteEXRPreviewWidthParamName);
+        param->setLabels(kWriteEXRPreviewWidthParamLabel, kWriteEXRPreviewWidthParamLabel, kWriteEXRPreviewWidthParamLabel);
+        param->setHint(kWriteEXRPreviewWidthParamHint);
+        param->setRange(1, INT_MAX);
+        param->setDisplayRange(64, 1024);
+        param->setDefault(256);
+        param->setAnimates(true);
+        page->addChild(*param);
+    }
+
+    ////////Encode stats
+    {
+        OFX::PushButtonParamDescriptor* param = desc.definePushButtonParam(kWriteEXREncodeStatsParamName);
+        param->setLabels(kWriteEXREncodeStatsParamLabel, kWriteEXREncodeStatsParamLabel, kWriteEXREncodeStatsParamLabel);
+        param->setHint(kWriteEXREncodeStatsParamHint);
+        page->addChild(*param);
+    }
+
     GenericWriterDescribeInContextEnd(desc, context, page);
 }
 
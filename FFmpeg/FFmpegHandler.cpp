@@ -46,16 +46,43 @@
 #endif
 #include "FFmpegHandler.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <stdexcept>
 
 #include "ReadFFmpeg.h"
 
 #if defined(_WIN32) || defined(WIN64)
 #  include <windows.h> // for GetSystemInfo()
+#  include <process.h> // for _beginthreadex()
 #else
 #  include <unistd.h> // for sysconf()
 #endif
+#include <sys/stat.h>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+}
+
+// maximum number of decoders kept open by the pool, for all files
+#define kFFmpegMaxDecodersEnv "OFX_IO_FFMPEG_MAX_DECODERS"
+#define kFFmpegMaxDecodersDefault 8
+// maximum number of decoders opened for the same file, unless they are all in use
+#define kFFmpegMaxDecodersPerFile 4
+// a decoder is reused without seeking if it is at most this number of frames before the requested frame
+#define kFFmpegMaxForwardDecode 64
+// memory used by each decoder to keep the last decoded frames, in megabytes (0 disables it)
+#define kFFmpegDecodedFramesCacheEnv "OFX_IO_FFMPEG_FRAME_CACHE_MB"
+#define kFFmpegDecodedFramesCacheDefault 128
+// directory where the packet indexes of the movies are cached. If it is not set, the index is built by each decoder.
+#define kFFmpegIndexDirEnv "OFX_IO_FFMPEG_INDEX_DIR"
+#define kFFmpegIndexMagic "OFXFFIDX"
+#define kFFmpegIndexVersion 1
+// number of frames decoded ahead of the last requested frame during playback (0 disables decode-ahead)
+#define kFFmpegDecodeAheadEnv "OFX_IO_FFMPEG_DECODE_AHEAD"
 
 // Use one decoding thread per processor for video decoding.
 // source: http://git.savannah.gnu.org/cgit/bino.git/tree/src/media_object.cpp
@@ -114,6 +141,192 @@ namespace FFmpeg {
         
     }
     
+    // the number of pixels of the picture per band, and the minimum height of a band
+#define kSliceConverterPixelsPerSlice (512 * 512)
+#define kSliceConverterMinSliceHeight 64
+    // the bands and their margins are aligned on this number of rows, which is a multiple of the chroma subsampling
+    // and of the dithering period of swscale
+#define kSliceConverterAlignment 16
+    
+    // true if the second data pointer of the pixel format is a palette, which is not split in bands
+    static bool hasPalette(const AVPixFmtDescriptor* desc)
+    {
+        uint64_t flags = 0;
+#if defined(AV_PIX_FMT_FLAG_PAL)
+        flags |= AV_PIX_FMT_FLAG_PAL;
+#elif defined(PIX_FMT_PAL)
+        flags |= PIX_FMT_PAL;
+#endif
+#if defined(AV_PIX_FMT_FLAG_PSEUDOPAL)
+        flags |= AV_PIX_FMT_FLAG_PSEUDOPAL;
+#elif defined(PIX_FMT_PSEUDOPAL)
+        flags |= PIX_FMT_PSEUDOPAL;
+#endif
+        return (desc->flags & flags) != 0;
+    }
+    
+    // offset the planes of a picture by a number of rows
+    template<typename T>
+    static void offsetPlanes(T* const data[], const int stride[], const AVPixFmtDescriptor* desc, int rows, T* planes[4])
+    {
+        for (int i = 0; i < 4; ++i) {
+            // the chroma planes are subsampled vertically
+            const int planeRows = (i == 1 || i == 2) ? (rows >> desc->log2_chroma_h) : rows;
+            planes[i] = data[i] ? data[i] + (ptrdiff_t)planeRows * stride[i] : NULL;
+        }
+    }
+    
+    SliceConverter::SliceConverter()
+    : _slices()
+    , _srcWidth(0)
+    , _dstWidth(0)
+    , _height(0)
+    , _flags(0)
+    , _nSlices(0)
+    , _srcFormat(PIX_FMT_NONE)
+    , _dstFormat(PIX_FMT_NONE)
+    , _srcData(0)
+    , _srcStride(0)
+    , _dstData(0)
+    , _dstStride(0)
+    {
+    }
+    
+    SliceConverter::~SliceConverter()
+    {
+        free();
+    }
+    
+    void SliceConverter::free()
+    {
+        for (std::vector<Slice>::iterator it = _slices.begin(); it != _slices.end(); ++it) {
+            if (it->_convertCtx) {
+                sws_freeContext(it->_convertCtx);
+            }
+            if (it->_scratchAllocated) {
+                avpicture_free(&it->_scratch);
+            }
+        }
+        _slices.clear();
+        _srcWidth = _dstWidth = _height = _flags = _nSlices = 0;
+        _srcFormat = _dstFormat = PIX_FMT_NONE;
+    }
+    
+    bool SliceConverter::allocate(int srcWidth, AVPixelFormat srcFormat, int dstWidth, AVPixelFormat dstFormat, int height, int flags, int nSlices)
+    {
+        free();
+        
+        // a single band converts directly to the destination
+        if (nSlices <= 1) {
+            Slice slice;
+            slice._convertCtx = sws_getContext(srcWidth, height, srcFormat, dstWidth, height, dstFormat, flags, NULL, NULL, NULL);
+            slice._y1 = slice._srcY1 = 0;
+            slice._y2 = slice._srcY2 = height;
+            slice._scratchAllocated = false;
+            if (!slice._convertCtx) {
+                return false;
+            }
+            _slices.push_back(slice);
+        } else {
+            const int sliceHeight = ((height / nSlices + kSliceConverterAlignment - 1) / kSliceConverterAlignment) * kSliceConverterAlignment;
+            for (int y1 = 0; y1 < height; y1 += sliceHeight) {
+                Slice slice;
+                slice._y1 = y1;
+                slice._y2 = std::min(y1 + sliceHeight, height);
+                slice._srcY1 = std::max(0, slice._y1 - kSliceConverterAlignment);
+                slice._srcY2 = std::min(height, slice._y2 + kSliceConverterAlignment);
+                slice._convertCtx = sws_getContext(srcWidth, slice._srcY2 - slice._srcY1, srcFormat,
+                                                   dstWidth, slice._srcY2 - slice._srcY1, dstFormat, flags, NULL, NULL, NULL);
+                slice._scratchAllocated = slice._convertCtx && avpicture_alloc(&slice._scratch, dstFormat, dstWidth, slice._srcY2 - slice._srcY1) >= 0;
+                _slices.push_back(slice);
+                if (!slice._scratchAllocated) {
+                    free();
+                    return false;
+                }
+            }
+        }
+        _srcWidth = srcWidth;
+        _srcFormat = srcFormat;
+        _dstWidth = dstWidth;
+        _dstFormat = dstFormat;
+        _height = height;
+        _flags = flags;
+        _nSlices = nSlices;
+        return true;
+    }
+    
+    bool SliceConverter::convert(const uint8_t* const srcData[], const int srcStride[], int srcWidth, AVPixelFormat srcFormat,
+                                 uint8_t* const dstData[], const int dstStride[], int dstWidth, AVPixelFormat dstFormat,
+                                 int height, int flags, bool multiThreaded)
+    {
+        const AVPixFmtDescriptor* srcDesc = av_pix_fmt_desc_get(srcFormat);
+        const AVPixFmtDescriptor* dstDesc = av_pix_fmt_desc_get(dstFormat);
+        if (!srcDesc || !dstDesc || height <= 0) {
+            return false;
+        }
+        
+        // the number of bands depends on the size of the picture
+        int nSlices = 1;
+        if (multiThreaded && !hasPalette(srcDesc) && !hasPalette(dstDesc)) {
+            nSlices = (int)std::min((int64_t)OFX::MultiThread::getNumCPUs(), ((int64_t)srcWidth * height) / kSliceConverterPixelsPerSlice);
+            nSlices = std::max(1, std::min(nSlices, height / kSliceConverterMinSliceHeight));
+        }
+        if (_slices.empty() || nSlices != _nSlices || srcWidth != _srcWidth || srcFormat != _srcFormat || dstWidth != _dstWidth ||
+            dstFormat != _dstFormat || height != _height || flags != _flags) {
+            if (!allocate(srcWidth, srcFormat, dstWidth, dstFormat, height, flags, nSlices)) {
+                return false;
+            }
+        }
+        
+        _srcData = srcData;
+        _srcStride = srcStride;
+        _dstData = dstData;
+        _dstStride = dstStride;
+        if (_slices.size() == 1) {
+            convertSlice(_slices[0]);
+        } else {
+            // the number of bands may be lower than nSlices, because of the alignment
+            multiThread((unsigned int)_slices.size());
+        }
+        _srcData = NULL;
+        _srcStride = NULL;
+        _dstData = NULL;
+        _dstStride = NULL;
+        return true;
+    }
+    
+    void SliceConverter::multiThreadFunction(unsigned int threadId, unsigned int nThreads)
+    {
+        // the suite may run fewer threads than requested
+        for (size_t i = threadId; i < _slices.size(); i += nThreads) {
+            convertSlice(_slices[i]);
+        }
+    }
+    
+    void SliceConverter::convertSlice(const Slice& slice)
+    {
+        const AVPixFmtDescriptor* srcDesc = av_pix_fmt_desc_get(_srcFormat);
+        const AVPixFmtDescriptor* dstDesc = av_pix_fmt_desc_get(_dstFormat);
+        
+        if (!slice._scratchAllocated) {
+            sws_scale(slice._convertCtx, _srcData, _srcStride, 0, _height, _dstData, _dstStride);
+            return;
+        }
+        
+        const uint8_t* src[4];
+        offsetPlanes(_srcData, _srcStride, srcDesc, slice._srcY1, src);
+        sws_scale(slice._convertCtx, src, _srcStride, 0, slice._srcY2 - slice._srcY1, slice._scratch.data, slice._scratch.linesize);
+        
+        // copy the rows of the band, without the margins
+        uint8_t* dst[4];
+        offsetPlanes(_dstData, _dstStride, dstDesc, slice._y1, dst);
+        int dstStride[4];
+        std::copy(_dstStride, _dstStride + 4, dstStride);
+        const uint8_t* scratch[4];
+        offsetPlanes((const uint8_t* const*)slice._scratch.data, slice._scratch.linesize, dstDesc, slice._y1 - slice._srcY1, scratch);
+        av_image_copy(dst, dstStride, scratch, slice._scratch.linesize, _dstFormat, _dstWidth, slice._y2 - slice._y1);
+    }
+    
     File::Stream::Stream()
     : _idx(0)
     , _avstream(NULL)
@@ -121,6 +334,9 @@ namespace FFmpeg {
     , _videoCodec(NULL)
     , _avFrame(NULL)
     , _convertCtx(NULL)
+    , _scaledConvertCtx(NULL)
+    , _sliceConverter()
+    , _multiThreadedConversion(true)
     , _fpsNum(1)
     , _fpsDen(1)
     , _startPTS(0)
@@ -130,9 +346,17 @@ namespace FFmpeg {
     , _width(0)
     , _height(0)
     , _aspect(1.0)
+    , _lowres(0)
+    , _decodedWidth(0)
+    , _decodedHeight(0)
+    , _outputPixelFormat(PIX_FMT_RGB24)
     , _decodeNextFrameIn(-1)
     , _decodeNextFrameOut(-1)
     , _accumDecodeLatency(0)
+    , _decodedFrames()
+    , _maxDecodedFrames(0)
+    , _keyFrameTimestamps()
+    , _keyFramePositions()
     {}
     
     File::Stream::~Stream()
@@ -146,6 +370,9 @@ namespace FFmpeg {
         
         if (_convertCtx)
             sws_freeContext(_convertCtx);
+        
+        if (_scaledConvertCtx)
+            sws_freeContext(_scaledConvertCtx);
     }
     
     int64_t File::Stream::frameToPts(int frame) const
@@ -162,19 +389,246 @@ namespace FFmpeg {
     
     SwsContext* File::Stream::getConvertCtx()
     {
-        if (!_convertCtx)
-            _convertCtx = sws_getContext(_width, _height, _codecContext->pix_fmt, _width, _height, PIX_FMT_RGB24, SWS_BICUBIC, NULL, NULL, NULL);
+        if (!_convertCtx) {
+            int flags = SWS_BICUBIC;
+            if (_outputPixelFormat != PIX_FMT_RGB24) {
+                // keep the precision of the deep sources, and interpolate the chroma at full resolution
+                flags |= SWS_ACCURATE_RND | SWS_FULL_CHR_H_INT;
+            }
+            _convertCtx = sws_getContext(_decodedWidth, _decodedHeight, _codecContext->pix_fmt, _width, _height, _outputPixelFormat, flags, NULL, NULL, NULL);
+        }
         
         return _convertCtx;
     }
     
+    SwsContext* File::Stream::getScaledConvertCtx(int width, int height)
+    {
+        // the context is only reallocated if the size changes
+        _scaledConvertCtx = sws_getCachedContext(_scaledConvertCtx, _decodedWidth, _decodedHeight, _codecContext->pix_fmt, width, height, _outputPixelFormat, SWS_AREA, NULL, NULL, NULL);
+        
+        return _scaledConvertCtx;
+    }
+    
+    void File::Stream::convertFrame(unsigned char* buffer, int width, int height)
+    {
+        AVPicture output;
+        avpicture_fill(&output, buffer, _outputPixelFormat, width, height);
+        
+        // without vertical scaling, which is the usual case (lowres decodes at the size of the mipmap level), the
+        // conversion is done in parallel bands
+        if (height == _decodedHeight) {
+            int flags = SWS_AREA;
+            if (width == _width && height == _height) {
+                flags = SWS_BICUBIC;
+                if (_outputPixelFormat != PIX_FMT_RGB24) {
+                    flags |= SWS_ACCURATE_RND | SWS_FULL_CHR_H_INT;
+                }
+            }
+            if (_sliceConverter.convert(_avFrame->data, _avFrame->linesize, _decodedWidth, _codecContext->pix_fmt,
+                                        output.data, output.linesize, width, _outputPixelFormat,
+                                        height, flags, _multiThreadedConversion)) {
+                return;
+            }
+        }
+        
+        SwsContext* convertCtx = (width == _width && height == _height) ? getConvertCtx() : getScaledConvertCtx(width, height);
+        sws_scale(convertCtx, _avFrame->data, _avFrame->linesize, 0, _decodedHeight, output.data, output.linesize);
+    }
+    
     // Return the number of input frames needed by this stream's codec before it can produce output. We expect to have to
     // wait this many frames to receive output; any more and a decode stall is detected.
     int File::Stream::getCodecDelay() const
     {
         return ((_videoCodec->capabilities & CODEC_CAP_DELAY) ? _codecContext->delay : 0) + _codecContext->has_b_frames;
     }
+    
+    size_t File::Stream::getFrameBytes(int width, int height) const
+    {
+        return (size_t)width * height * 3 * (_outputPixelFormat == PIX_FMT_RGB24 ? 1 : 2);
+    }
+    
+    const File::DecodedFrame* File::Stream::findDecodedFrame(int frame, int width, int height) const
+    {
+        // most recent first, since this is where a step backwards finds its frame
+        for (DecodedFramesList::const_reverse_iterator it = _decodedFrames.rbegin(); it != _decodedFrames.rend(); ++it) {
+            if (it->_frame == frame && it->_width == width && it->_height == height) {
+                return &*it;
+            }
+        }
+        return NULL;
+    }
+    
+    unsigned char* File::Stream::addDecodedFrame(int frame, int width, int height)
+    {
+        if (_maxDecodedFrames == 0) {
+            return NULL;
+        }
+        if (_decodedFrames.size() >= _maxDecodedFrames) {
+            // recycle the buffer of the oldest frame
+            _decodedFrames.splice(_decodedFrames.end(), _decodedFrames, _decodedFrames.begin());
+        } else {
+            _decodedFrames.push_back(DecodedFrame());
+        }
+        // _maxDecodedFrames is computed for full size frames, so the memory used stays bounded
+        DecodedFrame& decodedFrame = _decodedFrames.back();
+        decodedFrame._frame = frame;
+        decodedFrame._width = width;
+        decodedFrame._height = height;
+        decodedFrame._pixels.resize(getFrameBytes(width, height));
+        return &decodedFrame._pixels[0];
+    }
+    
+    void File::Stream::setPacketIndex(const PacketIndex& index)
+    {
+        // use the DTSs if the stream has no PTSs
+        bool ptsSeen = false;
+        for (PacketIndex::const_iterator it = index.begin(); it != index.end() && !ptsSeen; ++it) {
+            ptsSeen = (it->pts != int64_t(AV_NOPTS_VALUE));
+        }
+        if (!ptsSeen) {
+            _timestampField = &AVPacket::dts;
+        }
+        
+        std::vector<std::pair<int64_t, int64_t> > keyFrames;
+        for (PacketIndex::const_iterator it = index.begin(); it != index.end(); ++it) {
+            int64_t timestamp = ptsSeen ? it->pts : it->dts;
+            if (timestamp == int64_t(AV_NOPTS_VALUE)) {
+                continue;
+            }
+            if (it->keyFrame) {
+                keyFrames.push_back(std::make_pair(timestamp, it->pos));
+            }
+        }
+        std::sort(keyFrames.begin(), keyFrames.end());
+        
+        _keyFrameTimestamps.resize(keyFrames.size());
+        _keyFramePositions.resize(keyFrames.size());
+        for (size_t i = 0; i < keyFrames.size(); ++i) {
+            _keyFrameTimestamps[i] = keyFrames[i].first;
+            _keyFramePositions[i] = keyFrames[i].second;
+        }
+    }
+    
+    // the number of frames that fit in the decoded frames cache of a decoder
+    static size_t getMaxDecodedFrames(size_t frameBytes)
+    {
+        if (frameBytes == 0) {
+            return 0;
+        }
+        return FileManager::s_readerManager.getDecodedFramesCacheBytes() / frameBytes;
+    }
 
+    static void hashBytes(uint64_t* hash, const void* data, size_t size)
+    {
+        // FNV-1a
+        const unsigned char* bytes = (const unsigned char*)data;
+        for (size_t i = 0; i < size; ++i) {
+            *hash ^= bytes[i];
+            *hash *= UINT64_C(1099511628211);
+        }
+    }
+    
+    // The name of the cached packet index of a movie. The key is a hash of the file path, size and modification date,
+    // so that the index is rebuilt if the file changes. Returns false if there is no index cache.
+    static bool getIndexFilename(const std::string& filename, std::string* indexFilename)
+    {
+        const char* dir = std::getenv(kFFmpegIndexDirEnv);
+        if (!dir || !*dir) {
+            return false;
+        }
+        struct stat st;
+        if (stat(filename.c_str(), &st) != 0) {
+            return false;
+        }
+        uint64_t hash = UINT64_C(14695981039346656037);
+        hashBytes(&hash, filename.data(), filename.size());
+        int64_t size = (int64_t)st.st_size;
+        int64_t mtime = (int64_t)st.st_mtime;
+        hashBytes(&hash, &size, sizeof(size));
+        hashBytes(&hash, &mtime, sizeof(mtime));
+        
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.idx", (unsigned long long)hash);
+        *indexFilename = dir;
+        *indexFilename += '/';
+        *indexFilename += name;
+        return true;
+    }
+    
+    // Read the index written by savePacketIndex. The file is in native byte order, since the cache is local.
+    static bool loadPacketIndex(const std::string& indexFilename, std::map<int, PacketIndex>* index)
+    {
+        FILE* f = std::fopen(indexFilename.c_str(), "rb");
+        if (!f) {
+            return false;
+        }
+        char magic[8];
+        int32_t version = 0;
+        int32_t nStreams = 0;
+        bool ok = (std::fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+                   std::memcmp(magic, kFFmpegIndexMagic, sizeof(magic)) == 0 &&
+                   std::fread(&version, sizeof(version), 1, f) == 1 &&
+                   version == kFFmpegIndexVersion &&
+                   std::fread(&nStreams, sizeof(nStreams), 1, f) == 1);
+        for (int32_t i = 0; ok && i < nStreams; ++i) {
+            int32_t streamIdx;
+            int64_t count;
+            ok = (std::fread(&streamIdx, sizeof(streamIdx), 1, f) == 1 &&
+                  std::fread(&count, sizeof(count), 1, f) == 1 &&
+                  count >= 0 && count < (1 << 28));
+            if (!ok) {
+                break;
+            }
+            PacketIndex& packets = (*index)[streamIdx];
+            packets.resize((size_t)count);
+            for (PacketIndex::iterator it = packets.begin(); ok && it != packets.end(); ++it) {
+                int32_t keyFrame;
+                ok = (std::fread(&it->pts, sizeof(it->pts), 1, f) == 1 &&
+                      std::fread(&it->dts, sizeof(it->dts), 1, f) == 1 &&
+                      std::fread(&it->pos, sizeof(it->pos), 1, f) == 1 &&
+                      std::fread(&keyFrame, sizeof(keyFrame), 1, f) == 1);
+                it->keyFrame = (keyFrame != 0);
+            }
+        }
+        std::fclose(f);
+        if (!ok) {
+            index->clear();
+        }
+        return ok;
+    }
+    
+    static void savePacketIndex(const std::string& indexFilename, const std::map<int, PacketIndex>& index)
+    {
+        // write to a temporary file, so that another process never reads a partial index
+        std::string tmpFilename = indexFilename + ".tmp";
+        FILE* f = std::fopen(tmpFilename.c_str(), "wb");
+        if (!f) {
+            return;
+        }
+        int32_t version = kFFmpegIndexVersion;
+        int32_t nStreams = (int32_t)index.size();
+        bool ok = (std::fwrite(kFFmpegIndexMagic, 1, 8, f) == 8 &&
+                   std::fwrite(&version, sizeof(version), 1, f) == 1 &&
+                   std::fwrite(&nStreams, sizeof(nStreams), 1, f) == 1);
+        for (std::map<int, PacketIndex>::const_iterator it = index.begin(); ok && it != index.end(); ++it) {
+            int32_t streamIdx = it->first;
+            int64_t count = (int64_t)it->second.size();
+            ok = (std::fwrite(&streamIdx, sizeof(streamIdx), 1, f) == 1 &&
+                  std::fwrite(&count, sizeof(count), 1, f) == 1);
+            for (PacketIndex::const_iterator p = it->second.begin(); ok && p != it->second.end(); ++p) {
+                int32_t keyFrame = p->keyFrame;
+                ok = (std::fwrite(&p->pts, sizeof(p->pts), 1, f) == 1 &&
+                      std::fwrite(&p->dts, sizeof(p->dts), 1, f) == 1 &&
+                      std::fwrite(&p->pos, sizeof(p->pos), 1, f) == 1 &&
+                      std::fwrite(&keyFrame, sizeof(keyFrame), 1, f) == 1);
+            }
+        }
+        ok = (std::fclose(f) == 0) && ok;
+        if (!ok || std::rename(tmpFilename.c_str(), indexFilename.c_str()) != 0) {
+            std::remove(tmpFilename.c_str());
+        }
+    }
+    
     File::File()
     : _filename()
     , _context(NULL)
@@ -186,6 +640,23 @@ namespace FFmpeg {
 #ifdef OFX_IO_MT_FFMPEG
     , _lock(0)
 #endif
+    , _decodeAheadThread()
+    , _decodeAheadRunning(false)
+    , _decodeAheadCancel(false)
+    , _decodeAheadLock(0)
+    , _lastFrame(-1)
+    , _lastWidth(0)
+    , _lastHeight(0)
+    , _lastMaxRetries(0)
+    , _lastSequential(false)
+    , _indexThread()
+    , _indexRunning(false)
+    , _indexPending(false)
+    , _indexDone(false)
+    , _indexCancel(false)
+    , _indexLock(0)
+    , _indexFilename()
+    , _builtIndex()
     {
         
     }
@@ -201,16 +672,36 @@ namespace FFmpeg {
 #ifdef OFX_IO_MT_FFMPEG
     , _lock(0)
 #endif
+    , _decodeAheadThread()
+    , _decodeAheadRunning(false)
+    , _decodeAheadCancel(false)
+    , _decodeAheadLock(0)
+    , _lastFrame(-1)
+    , _lastWidth(0)
+    , _lastHeight(0)
+    , _lastMaxRetries(0)
+    , _lastSequential(false)
+    , _indexThread()
+    , _indexRunning(false)
+    , _indexPending(false)
+    , _indexDone(false)
+    , _indexCancel(false)
+    , _indexLock(0)
+    , _indexFilename()
+    , _builtIndex()
     {
         open(filename);
     }
     
     File::~File()
     {
+        stopDecodeAhead();
         close();
+        delete _decodeAheadLock;
+        delete _indexLock;
     }
 
-    void File::open(const std::string& filename)
+    void File::open(const std::string& filename, int lowres)
     {
 #ifdef OFX_IO_MT_FFMPEG
         OFX::MultiThread::AutoMutex guard(_lock);
@@ -237,6 +728,10 @@ namespace FFmpeg {
         
         CHECKMSG(avformat_find_stream_info(_context, NULL),"Could not find codec parameters");
         
+        // the packet index gives the exact key-frames of the streams
+        std::map<int, PacketIndex> packetIndex;
+        getPacketIndex(&packetIndex);
+        
         // fill the array with all available video streams
         bool unsuported_codec = false;
         
@@ -260,6 +755,15 @@ namespace FFmpeg {
                 continue;
             }
             
+            // the frame size, before the codec is opened with a reduced resolution
+            const int width = avstream->codec->width;
+            const int height = avstream->codec->height;
+            
+#ifdef FF_API_LOWRES
+            // decode at a reduced resolution if the codec supports it
+            avstream->codec->lowres = std::min(lowres, (int)videoCodec->max_lowres);
+#endif
+            
             if (avstream->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
                 // source: http://git.savannah.gnu.org/cgit/bino.git/tree/src/media_object.cpp
                 
@@ -295,8 +799,14 @@ namespace FFmpeg {
                 stream->_fpsDen = avstream->r_frame_rate.den;
             }
             
-            stream->_width  = avstream->codec->width;
-            stream->_height = avstream->codec->height;
+            stream->_width  = width;
+            stream->_height = height;
+            // the codec context has the size of the decoded pictures
+            stream->_decodedWidth  = avstream->codec->width;
+            stream->_decodedHeight = avstream->codec->height;
+#ifdef FF_API_LOWRES
+            stream->_lowres = avstream->codec->lowres;
+#endif
             
             // set aspect ratio
             if (stream->_avstream->sample_aspect_ratio.num) {
@@ -306,9 +816,24 @@ namespace FFmpeg {
                 stream->_aspect = av_q2d(stream->_codecContext->sample_aspect_ratio);
             }
             
+            // decode sources with more than 8 bits per component (e.g. 10-bit 4:2:2) to 16 bits RGB,
+            // so that their precision is not lost
+            const AVPixFmtDescriptor* pixFmtDesc = av_pix_fmt_desc_get(stream->_codecContext->pix_fmt);
+            if (pixFmtDesc && pixFmtDesc->comp[0].depth_minus1 >= 8) {
+                stream->_outputPixelFormat = PIX_FMT_RGB48;
+            }
+            
+            stream->_maxDecodedFrames = getMaxDecodedFrames(stream->getFrameBytes(width, height));
+            
             // set stream start time and numbers of frames
+            int64_t indexFrames = 0;
+            std::map<int, PacketIndex>::const_iterator streamIndex = packetIndex.find(i);
+            if (streamIndex != packetIndex.end() && !streamIndex->second.empty()) {
+                stream->setPacketIndex(streamIndex->second);
+                indexFrames = (int64_t)streamIndex->second.size();
+            }
             stream->_startPTS = getStreamStartTime(*stream);
-            stream->_frames   = getStreamFrames(*stream);
+            stream->_frames   = getStreamFrames(*stream, indexFrames);
             
             // save the stream
             _streams.push_back(stream);
@@ -320,9 +845,13 @@ namespace FFmpeg {
     
     void File::close()
     {
+        stopIndexThread();
+        
 #ifdef OFX_IO_MT_FFMPEG
         OFX::MultiThread::AutoMutex guard(_lock);
 #endif
+        _indexPending = false;
+        _builtIndex.clear();
         
         // force to close all resources needed for all streams
         for(unsigned int i = 0; i < _streams.size();++i){
@@ -443,7 +972,7 @@ namespace FFmpeg {
     }
     
     // Get the video stream duration in frames...
-    int64_t File::getStreamFrames(Stream& stream)
+    int64_t File::getStreamFrames(Stream& stream, int64_t indexFrames)
     {
         // Private, should not lock
         
@@ -500,6 +1029,12 @@ namespace FFmpeg {
             
         }
         
+        // If the number of frames is still unknown, take it from the packet index, which has one packet per frame in most
+        // streams.
+        if (!frames) {
+            frames = indexFrames;
+        }
+        
         // If the number of frames is still unknown, attempt to measure it from the last frame PTS for the stream in the
         // file relative to first (which we know from earlier).
         if (!frames) {
@@ -528,12 +1063,183 @@ namespace FFmpeg {
     }
     
     
+    bool File::getPacketIndex(std::map<int, PacketIndex>* index)
+    {
+        // Private, should not lock
+        
+        // without an index cache, the index is kept in memory by this decoder only
+        const bool cached = getIndexFilename(_filename, &_indexFilename);
+        if (!cached) {
+            _indexFilename.clear();
+        } else if (loadPacketIndex(_indexFilename, index)) {
+            return true;
+        }
+        
+        // Reading all the packets of a long movie takes a while: the index is built in a thread, and until it is ready,
+        // seeking relies on av_seek_frame alone. If another decoder of the file is building it, it is loaded from the cache
+        // once it is saved.
+        _indexPending = true;
+        if (cached) {
+            if (!FileManager::s_readerManager.beginIndexing(_indexFilename)) {
+                return false;
+            }
+            // another decoder may have saved it in the meantime
+            if (loadPacketIndex(_indexFilename, index)) {
+                FileManager::s_readerManager.endIndexing(_indexFilename);
+                _indexPending = false;
+                return true;
+            }
+        }
+        if (!_indexLock) {
+            _indexLock = new OFX::MultiThread::Mutex();
+        }
+        _indexDone = false;
+        _indexCancel = false;
+#ifdef _WIN32
+        _indexThread = (void*)_beginthreadex(NULL, 0, indexThreadMain, this, 0, NULL);
+        _indexRunning = (_indexThread != NULL);
+#else
+        _indexRunning = (pthread_create(&_indexThread, NULL, indexThreadMain, this) == 0);
+#endif
+        if (!_indexRunning) {
+            if (cached) {
+                FileManager::s_readerManager.endIndexing(_indexFilename);
+            }
+            _indexPending = false;
+        }
+        return false;
+    }
+    
+    void File::updatePacketIndex()
+    {
+        // Private, should not lock
+        
+        if (!_indexPending) {
+            return;
+        }
+        std::map<int, PacketIndex> index;
+        if (_indexRunning) {
+            {
+                OFX::MultiThread::AutoMutex guard(*_indexLock);
+                if (!_indexDone) {
+                    return;
+                }
+            }
+            stopIndexThread();
+            index.swap(_builtIndex);
+        } else {
+            // another decoder is building it: wait until it is in the index cache
+            assert(!_indexFilename.empty());
+            if (FileManager::s_readerManager.isIndexing(_indexFilename)) {
+                return;
+            }
+            loadPacketIndex(_indexFilename, &index);
+        }
+        _indexPending = false;
+        for (unsigned int i = 0; i < _streams.size(); ++i) {
+            std::map<int, PacketIndex>::const_iterator streamIndex = index.find(_streams[i]->_idx);
+            if (streamIndex != index.end() && !streamIndex->second.empty()) {
+                _streams[i]->setPacketIndex(streamIndex->second);
+            }
+        }
+    }
+    
+    void File::buildPacketIndex()
+    {
+        // the decoder has its own demuxer, which must not be used from this thread
+        AVFormatContext* context = NULL;
+        bool ok = false;
+        if (avformat_open_input(&context, _filename.c_str(), _format, NULL) >= 0) {
+            ok = true;
+            AVPacket packet;
+            av_init_packet(&packet);
+            for (int n = 0; av_read_frame(context, &packet) >= 0; ++n) {
+                AVStream* avstream = context->streams[packet.stream_index];
+                if (avstream && avstream->codec && avstream->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+                    PacketIndexEntry entry;
+                    entry.pts = packet.pts;
+                    entry.dts = packet.dts;
+                    entry.pos = packet.pos;
+                    entry.keyFrame = (packet.flags & AV_PKT_FLAG_KEY) != 0;
+                    _builtIndex[packet.stream_index].push_back(entry);
+                }
+                av_free_packet(&packet);
+                if ((n % 256) == 0) {
+                    OFX::MultiThread::AutoMutex guard(*_indexLock);
+                    if (_indexCancel) {
+                        ok = false;
+                        break;
+                    }
+                }
+            }
+            avformat_close_input(&context);
+        }
+        if (!ok) {
+            _builtIndex.clear();
+        }
+        if (!_indexFilename.empty()) {
+            if (!_builtIndex.empty()) {
+                savePacketIndex(_indexFilename, _builtIndex);
+            }
+            FileManager::s_readerManager.endIndexing(_indexFilename);
+        }
+        
+        OFX::MultiThread::AutoMutex guard(*_indexLock);
+        _indexDone = true;
+    }
+    
+    void File::stopIndexThread()
+    {
+        if (!_indexRunning) {
+            return;
+        }
+        {
+            OFX::MultiThread::AutoMutex guard(*_indexLock);
+            _indexCancel = true;
+        }
+#ifdef _WIN32
+        WaitForSingleObject((HANDLE)_indexThread, INFINITE);
+        CloseHandle((HANDLE)_indexThread);
+        _indexThread = NULL;
+#else
+        pthread_join(_indexThread, NULL);
+#endif
+        _indexRunning = false;
+    }
+    
+#ifdef _WIN32
+    unsigned __stdcall File::indexThreadMain(void* file)
+    {
+        static_cast<File*>(file)->buildPacketIndex();
+        return 0;
+    }
+#else
+    void* File::indexThreadMain(void* file)
+    {
+        static_cast<File*>(file)->buildPacketIndex();
+        return NULL;
+    }
+#endif
+    
     bool File::seekFrame(int frame,Stream* stream)
     {
         ///Private should not lock
 
         avcodec_flush_buffers(stream->_codecContext);
         int64_t timestamp = stream->frameToPts(frame);
+        if (!stream->_keyFrameTimestamps.empty()) {
+            // seek to the last key-frame at or before the frame, from the packet index
+            std::vector<int64_t>::const_iterator it = std::upper_bound(stream->_keyFrameTimestamps.begin(), stream->_keyFrameTimestamps.end(), timestamp);
+            size_t k = (it == stream->_keyFrameTimestamps.begin()) ? 0 : (size_t)(it - stream->_keyFrameTimestamps.begin()) - 1;
+            timestamp = stream->_keyFrameTimestamps[k];
+            // In formats with timestamp discontinuities (e.g. MPEG-TS), seeking by timestamp is a bisection over the file,
+            // whereas the byte offset of the key-frame is exact.
+            const int64_t pos = stream->_keyFramePositions[k];
+            if (pos >= 0 && (_context->iformat->flags & AVFMT_TS_DISCONT) && !(_context->iformat->flags & AVFMT_NO_BYTE_SEEK) &&
+                av_seek_frame(_context, stream->_idx, pos, AVSEEK_FLAG_BYTE) >= 0) {
+                return true;
+            }
+        }
         int error = av_seek_frame(_context, stream->_idx, timestamp, AVSEEK_FLAG_BACKWARD);
         if (error < 0) {
             // Seek error. Abort attempt to read and decode frames.
@@ -544,16 +1250,35 @@ namespace FFmpeg {
     }
     
     // decode a single frame into the buffer thread safe
-    bool File::decode(unsigned char* buffer, int frame, bool loadNearest, int maxRetries, unsigned streamIdx)
+    bool File::decode(unsigned char* buffer, int frame, bool loadNearest, int maxRetries, int width, int height, unsigned streamIdx)
     {
 #ifdef OFX_IO_MT_FFMPEG
         OFX::MultiThread::AutoMutex guard(_lock);
 #endif
+        
+        // record the request for decode-ahead
+        if (streamIdx == 0) {
+            _lastSequential = (frame == _lastFrame + 1 && width == _lastWidth && height == _lastHeight);
+            _lastFrame = frame;
+            _lastWidth = width;
+            _lastHeight = height;
+            _lastMaxRetries = maxRetries;
+        }
+        
+        return decodeFrame(buffer, frame, loadNearest, maxRetries, width, height, streamIdx);
+    }
+    
+    bool File::decodeFrame(unsigned char* buffer, int frame, bool loadNearest, int maxRetries, int width, int height, unsigned streamIdx)
+    {
+        // Private, should not lock
 
         if ( streamIdx >= _streams.size() ) {
             return false;
         }
         
+        // use the packet index as soon as it is ready
+        updatePacketIndex();
+        
         // get the stream
         Stream* stream = _streams[streamIdx];
         
@@ -607,6 +1332,20 @@ namespace FFmpeg {
         int lastSeekedFrame = -1; // 0-based index of the last frame to which we seeked when seek in progress / negative when no
                                   // seek in progress,
         
+        // A frame decoded recently, e.g. on the way to a later frame, is returned without seeking or touching the decoder.
+        const DecodedFrame* decodedFrame = stream->findDecodedFrame(frame, width, height);
+        if (decodedFrame) {
+            if (buffer) {
+                std::memcpy(buffer, &decodedFrame->_pixels[0], decodedFrame->_pixels.size());
+            }
+            return true;
+        }
+        
+        // The desired frame is only kept when decoding has to seek, e.g. when stepping backwards: during forward playback the
+        // next request is for the following frame, and keeping it would cost a copy of each frame. Without a buffer (when
+        // decoding ahead), it is only kept.
+        const bool keepFrame = !buffer || frame != stream->_decodeNextFrameOut;
+        
         if (frame != stream->_decodeNextFrameOut) {
             
             lastSeekedFrame = frame;
@@ -747,16 +1486,35 @@ namespace FFmpeg {
                 // stalls detected after this point will result in immediate decode failure.
                 awaitingFirstDecodeAfterSeek = false;
                 
+                // Keep the frames decoded on the way to the desired one (and the desired one), so that they can be returned
+                // without decoding from the key-frame again. Only the frames which are still in _decodedFrames when the
+                // desired frame is output are converted: the others would be recycled before being used. Frame indices are
+                // only guessed when retrying after a stall, so these frames are not kept.
+                const int frameOut = stream->_decodeNextFrameOut;
+                const bool isDesiredFrame = (frameOut == frame);
+                unsigned char* decodedFrameBuffer = 0;
+                if (retriesAttempts == 0 && (keepFrame || !isDesiredFrame) &&
+                    frameOut >= 0 && frameOut <= frame && (size_t)(frame - frameOut) < stream->_maxDecodedFrames &&
+                    !stream->findDecodedFrame(frameOut, width, height)) {
+                    decodedFrameBuffer = stream->addDecodedFrame(frameOut, width, height);
+                }
+                
                 // If the frame just output from decode is the desired one, get the decoded picture from it and set that we
                 // have a picture.
-                if (stream->_decodeNextFrameOut == frame) {
+                if (isDesiredFrame) {
                     
-                    AVPicture output;
-                    avpicture_fill(&output, buffer, PIX_FMT_RGB24, stream->_width, stream->_height);
-                    
-                    sws_scale(stream->getConvertCtx(), stream->_avFrame->data, stream->_avFrame->linesize, 0,  stream->_height, output.data, output.linesize);
+                    if (buffer) {
+                        stream->convertFrame(buffer, width, height);
+                        if (decodedFrameBuffer) {
+                            std::memcpy(decodedFrameBuffer, buffer, stream->getFrameBytes(width, height));
+                        }
+                    } else if (decodedFrameBuffer) {
+                        stream->convertFrame(decodedFrameBuffer, width, height);
+                    }
                     
                     hasPicture = true;
+                } else if (decodedFrameBuffer) {
+                    stream->convertFrame(decodedFrameBuffer, width, height);
                 }
                 
                 // Advance next output frame expected from decode.
@@ -836,6 +1594,518 @@ namespace FFmpeg {
         return hasPicture;
     }
     
+    bool File::decodeKeyFrame(unsigned char* buffer, int frame, int width, int height, unsigned streamIdx)
+    {
+#ifdef OFX_IO_MT_FFMPEG
+        OFX::MultiThread::AutoMutex guard(_lock);
+#endif
+        
+        if ( streamIdx >= _streams.size() ) {
+            return false;
+        }
+        
+        updatePacketIndex();
+        
+        Stream* stream = _streams[streamIdx];
+        
+        if (frame < 0) {
+            frame = 0;
+        } else if (frame >= stream->_frames) {
+            frame = (int)stream->_frames - 1;
+        }
+        
+        // The decoder is drained below, so decode has to seek next time, and must not decode ahead.
+        _lastSequential = false;
+        stream->_decodeNextFrameIn  = -1;
+        stream->_decodeNextFrameOut = -1;
+        stream->_accumDecodeLatency = 0;
+        
+        if (!seekFrame(frame, stream)) {
+            return false;
+        }
+        
+        // let the decoder discard anything but key-frames
+        stream->_codecContext->skip_frame = AVDISCARD_NONKEY;
+        
+        av_init_packet(&_avPacket);
+        
+        // Feed the packets of the stream into the decoder from the first key-frame packet, until it outputs the picture.
+        // Decoders with a delay (e.g. frame threading) only output it after some more packets, which are cheap to feed
+        // since the decoder discards the other frames. If the next key-frame packet is reached first, it is not fed, so
+        // that its picture is not output instead: the decoder is drained with null packets.
+        bool hasPicture = false;
+        bool fedKeyFrame = false;
+        bool draining = false;
+        int drainAttempts = 0;
+        while (!hasPicture) {
+            int frameDecoded = 0;
+            int error;
+            if (!draining) {
+                error = av_read_frame(_context, &_avPacket);
+                if (error < 0) {
+                    // EOF or read error: nothing more to feed
+                    av_init_packet(&_avPacket);
+                    _avPacket.data = NULL;
+                    _avPacket.size = 0;
+                    draining = true;
+                    continue;
+                }
+                const bool keyPacket = (_avPacket.flags & AV_PKT_FLAG_KEY) != 0;
+                if (_avPacket.stream_index != stream->_idx || (!fedKeyFrame && !keyPacket)) {
+                    av_free_packet(&_avPacket);
+                    continue;
+                }
+                if (fedKeyFrame && keyPacket) {
+                    av_free_packet(&_avPacket);
+                    av_init_packet(&_avPacket);
+                    _avPacket.data = NULL;
+                    _avPacket.size = 0;
+                    draining = true;
+                    continue;
+                }
+                error = avcodec_decode_video2(stream->_codecContext, stream->_avFrame, &frameDecoded, &_avPacket);
+                av_free_packet(&_avPacket);
+                _avPacket.data = NULL;
+                _avPacket.size = 0;
+                fedKeyFrame = true;
+            } else {
+                error = avcodec_decode_video2(stream->_codecContext, stream->_avFrame, &frameDecoded, &_avPacket);
+                if (!frameDecoded && ++drainAttempts > stream->getCodecDelay() + video_decoding_threads()) {
+                    setError("FFmpeg Reader failed to decode key frame, possible file corruption");
+                    break;
+                }
+            }
+            if (error < 0) {
+                setInternalError(error, "FFmpeg Reader failed to decode frame: ");
+                break;
+            }
+            if (frameDecoded) {
+                stream->convertFrame(buffer, width, height);
+                
+                hasPicture = true;
+            }
+        }
+        
+        stream->_codecContext->skip_frame = AVDISCARD_DEFAULT;
+        avcodec_flush_buffers(stream->_codecContext);
+        
+        return hasPicture;
+    }
+    
+    int File::getBytesPerComponent(unsigned streamIdx)
+    {
+#ifdef OFX_IO_MT_FFMPEG
+        OFX::MultiThread::AutoMutex guard(_lock);
+#endif
+        
+        if (streamIdx >= _streams.size())
+            return 1;
+        
+        return _streams[streamIdx]->_outputPixelFormat == PIX_FMT_RGB24 ? 1 : 2;
+    }
+    
+    int File::getLowres(unsigned streamIdx) const
+    {
+#ifdef OFX_IO_MT_FFMPEG
+        OFX::MultiThread::AutoMutex guard(_lock);
+#endif
+        
+        if (streamIdx >= _streams.size())
+            return 0;
+        
+        return _streams[streamIdx]->_lowres;
+    }
+    
+    int File::getMaxLowres(unsigned streamIdx) const
+    {
+#ifdef OFX_IO_MT_FFMPEG
+        OFX::MultiThread::AutoMutex guard(_lock);
+#endif
+        
+        if (streamIdx >= _streams.size())
+            return 0;
+        
+#ifdef FF_API_LOWRES
+        return _streams[streamIdx]->_videoCodec->max_lowres;
+#else
+        return 0;
+#endif
+    }
+    
+    int File::getNextFrame(unsigned streamIdx) const
+    {
+        if (_decodeAheadRunning) {
+            // the stream belongs to the decode-ahead thread, which continues decoding from the last requested frame
+            return streamIdx == 0 ? _lastFrame + 1 : -1;
+        }
+        
+#ifdef OFX_IO_MT_FFMPEG
+        OFX::MultiThread::AutoMutex guard(_lock);
+#endif
+        
+        if (streamIdx >= _streams.size())
+            return -1;
+        
+        return _streams[streamIdx]->_decodeNextFrameOut;
+    }
+    
+    bool File::hasDecodedFrame(int frame, unsigned streamIdx) const
+    {
+        if (_decodeAheadRunning) {
+            // the frames kept are being changed by the decode-ahead thread
+            return false;
+        }
+        
+#ifdef OFX_IO_MT_FFMPEG
+        OFX::MultiThread::AutoMutex guard(_lock);
+#endif
+        
+        if (streamIdx >= _streams.size())
+            return false;
+        
+        const DecodedFramesList& decodedFrames = _streams[streamIdx]->_decodedFrames;
+        for (DecodedFramesList::const_iterator it = decodedFrames.begin(); it != decodedFrames.end(); ++it) {
+            if (it->_frame == frame) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    void File::startDecodeAhead()
+    {
+        if (_decodeAheadRunning || !_lastSequential || _invalidState || _streams.empty()) {
+            return;
+        }
+        // the frames are decoded into _decodedFrames: leave room for the last requested frame
+        int frames = std::min(FileManager::s_readerManager.getDecodeAheadFrames(), (int)_streams[0]->_maxDecodedFrames - 1);
+        if (frames <= 0 || _lastFrame + 1 >= _streams[0]->_frames) {
+            return;
+        }
+        if (!_decodeAheadLock) {
+            _decodeAheadLock = new OFX::MultiThread::Mutex();
+        }
+        _decodeAheadCancel = false;
+#ifdef _WIN32
+        _decodeAheadThread = (void*)_beginthreadex(NULL, 0, decodeAheadThreadMain, this, 0, NULL);
+        _decodeAheadRunning = (_decodeAheadThread != NULL);
+#else
+        _decodeAheadRunning = (pthread_create(&_decodeAheadThread, NULL, decodeAheadThreadMain, this) == 0);
+#endif
+    }
+    
+    void File::stopDecodeAhead()
+    {
+        if (!_decodeAheadRunning) {
+            return;
+        }
+        {
+            OFX::MultiThread::AutoMutex guard(*_decodeAheadLock);
+            _decodeAheadCancel = true;
+        }
+#ifdef _WIN32
+        WaitForSingleObject((HANDLE)_decodeAheadThread, INFINITE);
+        CloseHandle((HANDLE)_decodeAheadThread);
+        _decodeAheadThread = NULL;
+#else
+        pthread_join(_decodeAheadThread, NULL);
+#endif
+        _decodeAheadRunning = false;
+    }
+    
+#ifdef _WIN32
+    unsigned __stdcall File::decodeAheadThreadMain(void* file)
+    {
+        static_cast<File*>(file)->decodeAhead();
+        return 0;
+    }
+#else
+    void* File::decodeAheadThreadMain(void* file)
+    {
+        static_cast<File*>(file)->decodeAhead();
+        return NULL;
+    }
+#endif
+    
+    void File::decodeAhead()
+    {
+#ifdef OFX_IO_MT_FFMPEG
+        OFX::MultiThread::AutoMutex guard(_lock);
+#endif
+        Stream* stream = _streams[0];
+        int frames = std::min(FileManager::s_readerManager.getDecodeAheadFrames(), (int)stream->_maxDecodedFrames - 1);
+        // the OFX multithread suite may only be used from the threads of the host
+        stream->_multiThreadedConversion = false;
+        // The frames decoded ahead may not exist (e.g. near the end of a file whose number of frames is overestimated), and
+        // a failure must not be reported to the next request: the error state is restored, and the next request seeks.
+        const bool invalidState = _invalidState;
+        const std::string errorMsg = _errorMsg;
+        for (int i = 1; i <= frames; ++i) {
+            {
+                OFX::MultiThread::AutoMutex guard(*_decodeAheadLock);
+                if (_decodeAheadCancel) {
+                    break;
+                }
+            }
+            int frame = _lastFrame + i;
+            if (frame >= stream->_frames) {
+                break;
+            }
+            bool decoded = false;
+            try {
+                // without a buffer, decodeFrame only keeps the frame
+                decoded = decodeFrame(NULL, frame, false, _lastMaxRetries, _lastWidth, _lastHeight, 0);
+            } catch (const std::exception&) {
+            }
+            if (!decoded) {
+                _invalidState = invalidState;
+                _errorMsg = errorMsg;
+                stream->_decodeNextFrameOut = -1;
+                break;
+            }
+        }
+        stream->_multiThreadedConversion = true;
+    }
+    
+    FileManager FileManager::s_readerManager;
+    
+    FileManager::FileManager()
+    : _decoders()
+    , _lock(0)
+    , _openLock(0)
+    , _maxDecoders(kFFmpegMaxDecodersDefault)
+    , _decodedFramesCacheBytes((size_t)kFFmpegDecodedFramesCacheDefault << 20)
+    , _decodeAheadFrames(0)
+    , _indexing()
+    , _isLoaded(false)
+    {
+    }
+    
+    FileManager::~FileManager()
+    {
+        for (DecodersList::iterator it = _decoders.begin(); it != _decoders.end(); ++it) {
+            delete it->file;
+        }
+        delete _lock;
+        delete _openLock;
+    }
+    
+    void FileManager::initialize()
+    {
+        if (!_isLoaded) {
+            const char* value = std::getenv(kFFmpegMaxDecodersEnv);
+            if (value) {
+                long l = std::strtol(value, NULL, 10);
+                if (l > 0) {
+                    _maxDecoders = (size_t)l;
+                }
+            }
+            value = std::getenv(kFFmpegDecodedFramesCacheEnv);
+            if (value) {
+                long l = std::strtol(value, NULL, 10);
+                if (l >= 0) {
+                    _decodedFramesCacheBytes = (size_t)l << 20;
+                }
+            }
+            value = std::getenv(kFFmpegDecodeAheadEnv);
+            if (value) {
+                long l = std::strtol(value, NULL, 10);
+                if (l > 0) {
+                    _decodeAheadFrames = (int)l;
+                }
+            }
+            _lock = new OFX::MultiThread::Mutex();
+            _openLock = new OFX::MultiThread::Mutex();
+            _isLoaded = true;
+        }
+    }
+    
+    File* FileManager::acquire(const std::string& filename, int frame, int lowres, bool keyFrames)
+    {
+        assert(_isLoaded);
+        File* file = 0;
+        bool reused = false;
+        {
+            OFX::MultiThread::AutoMutex guard(*_lock);
+            DecodersList::iterator best = _decoders.end(); // the closest idle decoder before the frame
+            DecodersList::iterator leastRecentlyUsed = _decoders.end(); // the least recently used idle decoder
+            int bestDistance = kFFmpegMaxForwardDecode + 1;
+            int count = 0;
+            for (DecodersList::iterator it = _decoders.begin(); it != _decoders.end(); ++it) {
+                // the lowres value the decoder would apply if it were opened for this request
+                const int effectiveLowres = (it->maxLowres >= 0) ? std::min(lowres, it->maxLowres) : lowres;
+                if (it->filename != filename || it->lowres != effectiveLowres) {
+                    continue;
+                }
+                ++count;
+                if (it->inUse) {
+                    continue;
+                }
+                leastRecentlyUsed = it;
+                if (keyFrames) {
+                    // key-frame decoding always seeks: use a decoder which is already decoding key-frames only,
+                    // rather than one which may continue decoding in sequence
+                    if (it->keyFrames) {
+                        best = it;
+                        break;
+                    }
+                    continue;
+                }
+                if (it->keyFrames) {
+                    // it seeked to a key-frame and was drained, it can't continue decoding in sequence
+                    continue;
+                }
+                if (it->file->hasDecodedFrame(frame)) {
+                    // the decoder still holds the frame, e.g. when stepping backwards
+                    best = it;
+                    break;
+                }
+                const int next = it->file->getNextFrame();
+                if (next >= 0 && next <= frame && frame - next < bestDistance) {
+                    best = it;
+                    bestDistance = frame - next;
+                }
+            }
+            if (best == _decoders.end() && count >= kFFmpegMaxDecodersPerFile) {
+                // all the decoders of the file would have to seek: use the one which is the least likely to be reused
+                best = leastRecentlyUsed;
+            }
+            if (best != _decoders.end()) {
+                best->inUse = true;
+                best->keyFrames = keyFrames;
+                _decoders.splice(_decoders.begin(), _decoders, best);
+                file = best->file;
+                reused = true;
+            } else {
+                // open a new decoder. It is in use, so that no other thread gets it before it is opened.
+                file = new File();
+                Decoder decoder;
+                decoder.file = file;
+                decoder.filename = filename;
+                decoder.lowres = lowres;
+                decoder.maxLowres = -1;
+                decoder.inUse = true;
+                decoder.keyFrames = keyFrames;
+                _decoders.push_front(decoder);
+            }
+        }
+        if (reused) {
+            // the decoder is ours: take it back from its decode-ahead thread, outside of the lock
+            file->stopDecodeAhead();
+            return file;
+        }
+        {
+            OFX::MultiThread::AutoMutex guard(*_openLock);
+            file->open(filename, lowres);
+        }
+        if (file->getNbStreams() > 0) {
+            // key the decoder on the lowres value which is actually applied
+            const int appliedLowres = file->getLowres();
+            const int maxLowres = file->getMaxLowres();
+            OFX::MultiThread::AutoMutex guard(*_lock);
+            for (DecodersList::iterator it = _decoders.begin(); it != _decoders.end(); ++it) {
+                if (it->file == file) {
+                    it->lowres = appliedLowres;
+                    it->maxLowres = maxLowres;
+                    break;
+                }
+            }
+        }
+        return file;
+    }
+    
+    void FileManager::release(File* file)
+    {
+        // during playback, decode the next frames while the decoder is idle. The error state is read first, since it may
+        // change transiently while decoding ahead.
+        const bool valid = file->isValid();
+        if (valid) {
+            file->startDecodeAhead();
+        }
+        
+        std::list<File*> toDelete;
+        {
+            OFX::MultiThread::AutoMutex guard(*_lock);
+            for (DecodersList::iterator it = _decoders.begin(); it != _decoders.end(); ++it) {
+                if (it->file == file) {
+                    if (valid) {
+                        it->inUse = false;
+                        _decoders.splice(_decoders.begin(), _decoders, it);
+                    } else {
+                        // the decoder is in an error state, the next decode will open a new one
+                        toDelete.push_back(file);
+                        _decoders.erase(it);
+                    }
+                    break;
+                }
+            }
+            // close the least recently used idle decoders
+            size_t n = _decoders.size();
+            DecodersList::iterator it = _decoders.end();
+            while (n > _maxDecoders && it != _decoders.begin()) {
+                --it;
+                if (!it->inUse) {
+                    toDelete.push_back(it->file);
+                    it = _decoders.erase(it);
+                    --n;
+                }
+            }
+        }
+        // close the files outside of the lock
+        for (std::list<File*>::iterator it = toDelete.begin(); it != toDelete.end(); ++it) {
+            delete *it;
+        }
+    }
+    
+    bool FileManager::beginIndexing(const std::string& indexFilename)
+    {
+        if (!_isLoaded) {
+            return true;
+        }
+        OFX::MultiThread::AutoMutex guard(*_lock);
+        return _indexing.insert(indexFilename).second;
+    }
+    
+    void FileManager::endIndexing(const std::string& indexFilename)
+    {
+        if (!_isLoaded) {
+            return;
+        }
+        OFX::MultiThread::AutoMutex guard(*_lock);
+        _indexing.erase(indexFilename);
+    }
+    
+    bool FileManager::isIndexing(const std::string& indexFilename)
+    {
+        if (!_isLoaded) {
+            return false;
+        }
+        OFX::MultiThread::AutoMutex guard(*_lock);
+        return _indexing.count(indexFilename) != 0;
+    }
+    
+    void FileManager::clear()
+    {
+        if (!_isLoaded) {
+            return;
+        }
+        std::list<File*> toDelete;
+        {
+            OFX::MultiThread::AutoMutex guard(*_lock);
+            for (DecodersList::iterator it = _decoders.begin(); it != _decoders.end();) {
+                if (it->inUse) {
+                    ++it;
+                } else {
+                    toDelete.push_back(it->file);
+                    it = _decoders.erase(it);
+                }
+            }
+        }
+        for (std::list<File*>::iterator it = toDelete.begin(); it != toDelete.end(); ++it) {
+            delete *it;
+        }
+    }
+    
     bool File::getFPS(double& fps,
                 unsigned streamIdx)
     {
@@ -51,6 +51,8 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <list>
+#include <set>
 
 #include <locale>
 #include <cstdio>
@@ -65,11 +67,14 @@ extern "C" {
 #include <libswscale/swscale.h>
 #include <libavutil/avutil.h>
 #include <libavutil/error.h>
+#include <libavutil/pixdesc.h>
 }
 #include "FFmpegCompat.h"
 
-#ifdef OFX_IO_MT_FFMPEG
 #include "ofxsMultiThread.h"
+
+#ifndef _WIN32
+#include <pthread.h>
 #endif
 
 #define CHECK(x) \
@@ -96,9 +101,82 @@ namespace FFmpeg {
     
     bool isImageFile(const std::string& filename);
     
+    // an entry of the packet index of a video stream
+    struct PacketIndexEntry
+    {
+        int64_t pts;
+        int64_t dts;
+        int64_t pos;   // byte offset of the packet in the file, or -1 if unknown
+        bool keyFrame;
+    };
+    typedef std::vector<PacketIndexEntry> PacketIndex;
+    
+    // Converts pictures with swscale in horizontal bands, in parallel through the OFX multithread suite.
+    // The pictures may be scaled horizontally but not vertically. Each band has its own SwsContext, and is converted with
+    // a margin of rows around it, so that the vertical filters and the dithering give the same result as a conversion of
+    // the whole picture.
+    class SliceConverter : public OFX::MultiThread::Processor
+    {
+    public:
+        SliceConverter();
+        
+        virtual ~SliceConverter();
+        
+        // Convert a srcWidth x height picture to a dstWidth x height picture. The bands and their contexts are only
+        // reallocated when the parameters change. Returns false if a context could not be allocated.
+        bool convert(const uint8_t* const srcData[], const int srcStride[], int srcWidth, AVPixelFormat srcFormat,
+                     uint8_t* const dstData[], const int dstStride[], int dstWidth, AVPixelFormat dstFormat,
+                     int height, int flags, bool multiThreaded = true);
+        
+    private:
+        struct Slice
+        {
+            SwsContext* _convertCtx;
+            int _y1, _y2;         // the rows of the band
+            int _srcY1, _srcY2;   // the rows converted, including the margins
+            AVPicture _scratch;   // the converted rows, which are copied to the band
+            bool _scratchAllocated;
+        };
+        
+        bool allocate(int srcWidth, AVPixelFormat srcFormat, int dstWidth, AVPixelFormat dstFormat, int height, int flags, int nSlices);
+        
+        void free();
+        
+        void convertSlice(const Slice& slice);
+        
+        virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads);
+        
+        std::vector<Slice> _slices;
+        
+        // the parameters of the contexts
+        int _srcWidth;
+        int _dstWidth;
+        int _height;
+        int _flags;
+        int _nSlices;
+        AVPixelFormat _srcFormat;
+        AVPixelFormat _dstFormat;
+        
+        // the picture being converted
+        const uint8_t* const* _srcData;
+        const int* _srcStride;
+        uint8_t* const* _dstData;
+        const int* _dstStride;
+    };
+    
 
     class File {
         
+        // a decoded frame, converted to the output pixel format
+        struct DecodedFrame
+        {
+            int _frame;
+            int _width;  // the size the frame was converted to
+            int _height;
+            std::vector<unsigned char> _pixels;
+        };
+        typedef std::list<DecodedFrame> DecodedFramesList;
+        
         struct Stream
         {
             int _idx;                      // stream index
@@ -107,6 +185,9 @@ namespace FFmpeg {
             AVCodec* _videoCodec;
             AVFrame* _avFrame;             // decoding frame
             SwsContext* _convertCtx;
+            SwsContext* _scaledConvertCtx; // converts to a lower resolution
+            SliceConverter _sliceConverter; // converts in parallel when the decoded picture has the height of the output
+            bool _multiThreadedConversion;  // false when converting from a thread which was not started by the host
             
             int _fpsNum;
             int _fpsDen;
@@ -123,6 +204,12 @@ namespace FFmpeg {
             int _height;
             double _aspect;
             
+            int _lowres;        // The codec decodes at a resolution reduced by 2^_lowres
+            int _decodedWidth;  // The size of the pictures output by the codec, which is lower than _width x _height
+            int _decodedHeight; // when decoding at reduced resolution.
+            
+            AVPixelFormat _outputPixelFormat; // PIX_FMT_RGB48 for sources with more than 8 bits per component, else PIX_FMT_RGB24
+            
             int _decodeNextFrameIn; // The 0-based index of the next frame to be fed into decode. Negative before any
                                     // frames have been decoded or when we've just seeked but not yet found a relevant frame. Equal to
                                     // frames_ when all available frames have been fed into decode.
@@ -135,6 +222,15 @@ namespace FFmpeg {
                                      // since the last seek. This is part of a guard mechanism to detect when decode appears to have
                                      // stalled and ensure that FFmpegFile::decode() does not loop indefinitely.
             
+            DecodedFramesList _decodedFrames; // The most recently decoded frames, oldest first. When decode has to start from a
+                                              // key-frame, the frames decoded on the way to the desired frame are kept, so that
+                                              // stepping backwards does not seek and decode the whole GOP again.
+            size_t _maxDecodedFrames;         // The maximum number of frames in _decodedFrames, from the frame size and the cache size
+            
+            std::vector<int64_t> _keyFrameTimestamps; // The timestamps of the key-frames from the packet index, sorted. Empty if the
+                                                      // file is not indexed, in which case seeking relies on av_seek_frame alone.
+            std::vector<int64_t> _keyFramePositions;  // The byte offsets of these key-frames in the file, or -1 if unknown
+            
             Stream();
             
             ~Stream();
@@ -145,10 +241,29 @@ namespace FFmpeg {
             
             SwsContext* getConvertCtx();
             
+            SwsContext* getScaledConvertCtx(int width, int height);
+            
+            // convert the decoded picture to width*height RGB pixels, scaling it if it is not the size of the frame
+            void convertFrame(unsigned char* buffer, int width, int height);
+            
             // Return the number of input frames needed by this stream's codec before it can produce output. We expect to have to
             // wait this many frames to receive output; any more and a decode stall is detected.
             int getCodecDelay() const;
             
+            // the size in bytes of a frame converted to the output pixel format at the given size
+            size_t getFrameBytes(int width, int height) const;
+            
+            // Return the decoded frame converted to the given size, or NULL if it is not in _decodedFrames.
+            const DecodedFrame* findDecodedFrame(int frame, int width, int height) const;
+            
+            // Return the buffer where a newly decoded frame is to be stored, recycling the oldest frame if _decodedFrames is
+            // full, or NULL if frames are not kept.
+            unsigned char* addDecodedFrame(int frame, int width, int height);
+            
+            // Set the key-frames of the stream from its packet index, and use the DTSs if the stream has no PTSs. The start
+            // PTS and the number of frames still come from the container (see getStreamFrames).
+            void setPacketIndex(const PacketIndex& index);
+            
         };
         
         std::string _filename;
@@ -170,6 +285,39 @@ namespace FFmpeg {
         // internal lock for multithread access
         mutable OFX::MultiThread::Mutex _lock;
 #endif
+        
+        // Decode-ahead: during playback, while the decoder is idle in the pool, a thread decodes the frames following the
+        // last requested one into _decodedFrames. It must keep running after the render action returns, which
+        // OFX::MultiThread::Processor can't do (multiThread returns once all its threads are done), so it is a native
+        // thread. It is not a host thread, so it converts the frames in a single band.
+#ifdef _WIN32
+        void* _decodeAheadThread;
+#else
+        pthread_t _decodeAheadThread;
+#endif
+        bool _decodeAheadRunning;                  // only changed by the thread which checked out the decoder
+        bool _decodeAheadCancel;                   // protected by _decodeAheadLock
+        OFX::MultiThread::Mutex* _decodeAheadLock;
+        int _lastFrame;                            // the last frame requested from decode, and how it was requested
+        int _lastWidth;
+        int _lastHeight;
+        int _lastMaxRetries;
+        bool _lastSequential;                      // true if the last frame requested followed the frame requested before
+        
+        // Packet index: if it is not in the index cache yet, it is built by a thread with its own demuxer, and used by the
+        // decoders of the file once it is ready. Without an index cache, each decoder builds its own index.
+#ifdef _WIN32
+        void* _indexThread;
+#else
+        pthread_t _indexThread;
+#endif
+        bool _indexRunning;                        // only changed by the thread which checked out the decoder
+        bool _indexPending;                        // the index is being built, by this decoder or by another one
+        bool _indexDone;                           // protected by _indexLock
+        bool _indexCancel;                         // protected by _indexLock
+        OFX::MultiThread::Mutex* _indexLock;
+        std::string _indexFilename;                // empty if there is no index cache
+        std::map<int, PacketIndex> _builtIndex;    // the index built by the thread
 
         // set reader error
         void setError(const char* msg, const char* prefix = 0);
@@ -180,11 +328,46 @@ namespace FFmpeg {
         // get stream start time
         int64_t getStreamStartTime(Stream& stream);
         
-        // Get the video stream duration in frames...
-        int64_t getStreamFrames(Stream& stream);
+        // Get the video stream duration in frames. indexFrames is the number of packets in the packet index of the stream,
+        // which is only used if the container does not give the duration, since a frame may be stored in several packets
+        // (e.g. field-coded streams) and edit lists may only present part of the packets.
+        int64_t getStreamFrames(Stream& stream, int64_t indexFrames = 0);
         
         bool seekFrame(int frame,Stream* stream);
         
+        // Load the packet index of the video streams from the index cache. If it is not there, start building it in a thread
+        // and return false: updatePacketIndex uses it once it is ready. Without an index cache, it is always built.
+        bool getPacketIndex(std::map<int, PacketIndex>* index);
+        
+        // Set the packet index of the streams once it has been built, by this decoder or by another one of the same file.
+        void updatePacketIndex();
+        
+        // Read all the packets of the file with a separate demuxer, and record those of the video streams in _builtIndex.
+        // The index is saved to the index cache, if there is one.
+        void buildPacketIndex();
+        
+        // Cancel the index thread if it is still running, and wait for it.
+        void stopIndexThread();
+        
+#ifdef _WIN32
+        static unsigned __stdcall indexThreadMain(void* file);
+#else
+        static void* indexThreadMain(void* file);
+#endif
+        
+        // the implementation of decode, which does not lock nor record the request. If buffer is NULL, the frame is only
+        // kept in _decodedFrames.
+        bool decodeFrame(unsigned char* buffer, int frame, bool loadNearest, int maxRetries, int width, int height, unsigned streamIdx);
+        
+        // the body of the decode-ahead thread
+        void decodeAhead();
+        
+#ifdef _WIN32
+        static unsigned __stdcall decodeAheadThreadMain(void* file);
+#else
+        static void* decodeAheadThreadMain(void* file);
+#endif
+        
     public:
         
         File();
@@ -193,7 +376,9 @@ namespace FFmpeg {
         
         ~File();
         
-        void open(const std::string& filename);
+        // Open the file. If lowres is not 0, decoders which support it (e.g. MJPEG, MPEG-4 part 2) decode the frames at a
+        // resolution reduced by up to 2^lowres, which makes decoding to a lower resolution faster.
+        void open(const std::string& filename, int lowres = 0);
         
         // Returns whether the file is opened, though it may be in an error state.
         bool isOpened() const;
@@ -211,8 +396,38 @@ namespace FFmpeg {
         // return the numbers of streams supported by the reader
         unsigned int getNbStreams() const;
         
-        // decode a single frame into the buffer thread safe
-        bool decode(unsigned char* buffer, int frame,bool loadNearest, int maxRetries, unsigned streamIdx = 0);
+        // decode a single frame into the buffer thread safe.
+        // The buffer contains width*height RGB pixels, with getBytesPerComponent() bytes per component. If width*height is
+        // lower than the frame size given by getInfo, the frame is downscaled.
+        bool decode(unsigned char* buffer, int frame,bool loadNearest, int maxRetries, int width, int height, unsigned streamIdx = 0);
+        
+        // Decode only the key-frame at or before the frame, skipping all the other frames, and convert it to width*height RGB
+        // pixels, e.g. at a lower resolution. This is much faster than decode for long-GOP movies, and is used for scrubbing.
+        // The next call to decode will seek.
+        bool decodeKeyFrame(unsigned char* buffer, int frame, int width, int height, unsigned streamIdx = 0);
+        
+        // 2 (native endian unsigned shorts) if the stream has more than 8 bits per component, else 1
+        int getBytesPerComponent(unsigned streamIdx = 0);
+        
+        // the resolution reduction applied by the codec, which is lower than the one given to open if the codec does not
+        // support it
+        int getLowres(unsigned streamIdx = 0) const;
+        
+        // the maximum resolution reduction supported by the codec (0 if it does not support decoding at a reduced resolution)
+        int getMaxLowres(unsigned streamIdx = 0) const;
+        
+        // the 0-based index of the next frame that decode will output without seeking, or a negative value if unknown
+        int getNextFrame(unsigned streamIdx = 0) const;
+        
+        // return true if the frame was recently decoded and is still kept by the reader, so that decode will not need to seek
+        bool hasDecodedFrame(int frame, unsigned streamIdx = 0) const;
+        
+        // If decode-ahead is enabled (see OFX_IO_FFMPEG_DECODE_AHEAD) and the last frames were requested in sequence, start
+        // decoding the following frames in a thread. Called when the decoder goes back to the pool.
+        void startDecodeAhead();
+        
+        // Cancel the decode-ahead thread, and wait until it has finished decoding its current frame.
+        void stopDecodeAhead();
         
         // get stream information
         bool getFPS(double& fps,
@@ -228,6 +443,91 @@ namespace FFmpeg {
         
     };
     
+    // A pool of decoders shared by all the reader instances, so that several frames of a movie can be decoded
+    // in parallel without making a single decoder seek back and forth. For each decode, the idle decoder which
+    // still holds the frame or can reach it by decoding forward is checked out. If there is none, a new decoder is opened, up to
+    // a number of decoders per file, after which the least recently used idle decoder seeks.
+    class FileManager
+    {
+        struct Decoder {
+            File* file;
+            std::string filename; ///< the file may be opening or decoding in another thread
+            int lowres; ///< the lowres value applied by the codec
+            int maxLowres; ///< the maximum lowres value supported by the codec, or -1 while the file is opening
+            bool inUse;
+            bool keyFrames; ///< the decoder was last checked out to decode key-frames only
+        };
+        typedef std::list<Decoder> DecodersList;
+        
+        DecodersList _decoders; ///< most recently used first
+        OFX::MultiThread::Mutex* _lock;
+        OFX::MultiThread::Mutex* _openLock; ///< decoders are opened one at a time, since avcodec_open2 is not thread-safe
+        size_t _maxDecoders; ///< maximum number of decoders kept open, for all files
+        size_t _decodedFramesCacheBytes; ///< memory used by each decoder to keep the last decoded frames
+        int _decodeAheadFrames; ///< number of frames decoded ahead of the last requested frame, 0 if disabled
+        std::set<std::string> _indexing; ///< the index files being built, so that a file is only indexed by one decoder
+        bool _isLoaded; ///< the mutexes can only be created once the OpenFX suites are loaded
+        
+    public:
+        
+        // singleton
+        static FileManager s_readerManager;
+        
+        FileManager();
+        
+        ~FileManager();
+        
+        // read the settings from the environment, and create the mutexes. Called from the load action, so that the
+        // settings are never changed while they are read by the decoders.
+        void initialize();
+        
+        size_t getDecodedFramesCacheBytes() const { return _decodedFramesCacheBytes; }
+        
+        int getDecodeAheadFrames() const { return _decodeAheadFrames; }
+        
+        // get a decoder for the given file, to decode the given frame. It must be given back with release().
+        // Decoders which apply a different lowres value are never shared: for codecs which do not support lowres, all the
+        // requests share the full resolution decoders.
+        // If keyFrames, the decoder is used with File::decodeKeyFrame: a decoder already used for key-frames is checked out,
+        // or a new one is opened, so that the decoders playing the file in sequence are only taken when there are too many.
+        File* acquire(const std::string& filename, int frame, int lowres = 0, bool keyFrames = false);
+        
+        // give back a decoder obtained from acquire()
+        void release(File* file);
+        
+        // close all the decoders which are not in use
+        void clear();
+        
+        // Register the packet index file built by a decoder. Returns false if another decoder is already building it.
+        bool beginIndexing(const std::string& indexFilename);
+        
+        void endIndexing(const std::string& indexFilename);
+        
+        bool isIndexing(const std::string& indexFilename);
+    };
+    
+    // A decoder checked out from the pool for the lifetime of the object
+    class FileLocker
+    {
+    public:
+        FileLocker(const std::string& filename, int frame, int lowres = 0, bool keyFrames = false)
+        : _file(FileManager::s_readerManager.acquire(filename, frame, lowres, keyFrames))
+        {
+        }
+        
+        ~FileLocker()
+        {
+            FileManager::s_readerManager.release(_file);
+        }
+        
+        File* operator->() const { return _file; }
+        
+        File* get() const { return _file; }
+        
+    private:
+        File* _file;
+    };
+    
 } //namespace FFmpeg
 
 
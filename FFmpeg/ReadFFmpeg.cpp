@@ -48,6 +48,12 @@
 #include <cmath>
 #include <sstream>
 #include <algorithm>
+#include <vector>
+#include <cstring>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OFX_IO_FFMPEG_HAS_SSE2
+#endif
 
 #include "IOUtility.h"
 
@@ -66,6 +72,15 @@
 #define kMaxRetriesParamHint "Some video files are sometimes tricky to read and needs several retries before successfully decoding a frame. This" \
 " parameter controls how many times we should attempt to decode the same frame before failing. "
 
+#define kFastScrubParamName "fastScrub"
+#define kFastScrubParamLabel "Fast scrub"
+#define kFastScrubParamHint "When rendering at a render scale lower than 1 (e.g. when the host viewer is in proxy mode while scrubbing " \
+"the timeline), only decode the key frame at or before each requested frame, skipping all the other frames, and scale it directly " \
+"to the render scale. Frames are still decoded exactly at full scale."
+
+// the maximum resolution reduction supported by the FFmpeg decoders (AVCodec::max_lowres)
+#define kMaxLowres 3
+
 #define kSupportsRGBA true
 #define kSupportsRGB true
 #define kSupportsAlpha false
@@ -73,13 +88,11 @@
 
 class ReadFFmpegPlugin : public GenericReaderPlugin
 {
-    FFmpeg::File* _ffmpegFile; 
-
-    unsigned char* _buffer;
-    int _bufferWidth;
-    int _bufferHeight;
+    FFmpeg::File* _ffmpegFile; ///< used to get the file information. Frames are decoded by the decoders of FFmpeg::FileManager
+    mutable OFX::MultiThread::Mutex _ffmpegFileLock; ///< protects _ffmpegFile, which may be used by several render threads
 
     OFX::IntParam *_maxRetries;
+    OFX::BooleanParam *_fastScrub;
     
 public:
 
@@ -99,6 +112,10 @@ private:
 
     virtual void decode(const std::string& filename, OfxTime time, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int rowBytes) OVERRIDE FINAL;
 
+    virtual unsigned int getFileMipmapLevel(const std::string& filename, OfxTime time, unsigned int level) OVERRIDE FINAL;
+
+    virtual void decodeMipmapLevel(const std::string& filename, OfxTime time, unsigned int level, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int rowBytes) OVERRIDE FINAL;
+
     virtual bool getSequenceTimeDomain(const std::string& filename,OfxRangeD &range) OVERRIDE FINAL;
 
     virtual bool getFrameBounds(const std::string& filename, OfxTime time, OfxRectI *bounds, double *par, std::string *error) OVERRIDE FINAL;
@@ -106,25 +123,25 @@ private:
     virtual bool getFrameRate(const std::string& filename, double* fps) const OVERRIDE FINAL;
     
     virtual void restoreState(const std::string& filename) OVERRIDE FINAL;
+
+    virtual void clearAnyCache() OVERRIDE FINAL;
 };
 
 ReadFFmpegPlugin::ReadFFmpegPlugin(OfxImageEffectHandle handle)
 : GenericReaderPlugin(handle, kSupportsRGBA, kSupportsRGB, kSupportsAlpha, kSupportsTiles)
 , _ffmpegFile(new FFmpeg::File())
-, _buffer(0)
-, _bufferWidth(0)
-, _bufferHeight(0)
+, _ffmpegFileLock()
 , _maxRetries(0)
+, _fastScrub(0)
 {
+    FFmpeg::FileManager::s_readerManager.initialize();
     _maxRetries = fetchIntParam(kMaxRetriesParamName);
-    assert(_maxRetries);
+    _fastScrub = fetchBooleanParam(kFastScrubParamName);
+    assert(_maxRetries && _fastScrub);
 }
 
 ReadFFmpegPlugin::~ReadFFmpegPlugin() {
     
-    if(_buffer){
-        delete [] _buffer;
-    }
     if (_ffmpegFile) {
         delete _ffmpegFile;
     }
@@ -135,7 +152,7 @@ ReadFFmpegPlugin::restoreState(const std::string& filename)
 {
     assert(_ffmpegFile);
     if (_ffmpegFile) {
-        
+        OFX::MultiThread::AutoMutex guard(_ffmpegFileLock);
         
         if (_ffmpegFile->getFilename() != filename) {
             _ffmpegFile->close();
@@ -146,6 +163,12 @@ ReadFFmpegPlugin::restoreState(const std::string& filename)
 
 }
 
+void
+ReadFFmpegPlugin::clearAnyCache()
+{
+    FFmpeg::FileManager::s_readerManager.clear();
+}
+
 bool ReadFFmpegPlugin::loadNearestFrame() const {
     int v;
     _missingFrameParam->getValue(v);
@@ -169,6 +192,7 @@ ReadFFmpegPlugin::onInputFileChanged(const std::string& filename,
     
     assert(_ffmpegFile);
     if (_ffmpegFile) {
+        OFX::MultiThread::AutoMutex guard(_ffmpegFileLock);
         if (_ffmpegFile->getFilename() == filename) {
             return;
         } else {
@@ -186,9 +210,70 @@ bool ReadFFmpegPlugin::isVideoStream(const std::string& filename){
     return !FFmpeg::isImageFile(filename);
 }
 
-template<int nComponents>
+#ifdef OFX_IO_FFMPEG_HAS_SSE2
+// load 4 components as 32-bit integers
+static inline __m128i
+loadComponents(const unsigned char* src)
+{
+    int v;
+    std::memcpy(&v, src, sizeof(v));
+    const __m128i zero = _mm_setzero_si128();
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero), zero);
+}
+
+static inline __m128i
+loadComponents(const unsigned short* src)
+{
+    return _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)src), _mm_setzero_si128());
+}
+#endif
+
+// Convert n components to float, like intToFloat<numVals>.
+template<typename PIX, int numVals>
+static void
+componentsToFloat(const PIX* src, int n, float* dst)
+{
+    int i = 0;
+#ifdef OFX_IO_FFMPEG_HAS_SSE2
+    const __m128 scale = _mm_set1_ps((float)(numVals - 1));
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(dst + i, _mm_div_ps(_mm_cvtepi32_ps(loadComponents(src + i)), scale));
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = intToFloat<numVals>(src[i]);
+    }
+}
+
+// Convert n RGB pixels to RGBA float pixels, with alpha = 0.
+template<typename PIX, int numVals>
+static void
+rgbToRGBAFloat(const PIX* src, int n, float* dst)
+{
+    int x = 0;
+#ifdef OFX_IO_FFMPEG_HAS_SSE2
+    const __m128 scale = _mm_set1_ps((float)(numVals - 1));
+    const __m128i rgbMask = _mm_set_epi32(0, -1, -1, -1);
+    // 4 components are loaded for each pixel: the last pixel is converted below, so that the row is not overrun
+    for (; x + 1 < n; ++x) {
+        const __m128i rgb = _mm_and_si128(loadComponents(src + x * 3), rgbMask);
+        _mm_storeu_ps(dst + x * 4, _mm_div_ps(_mm_cvtepi32_ps(rgb), scale));
+    }
+#endif
+    for (; x < n; ++x) {
+        dst[x * 4 + 0] = intToFloat<numVals>(src[x * 3 + 0]);
+        dst[x * 4 + 1] = intToFloat<numVals>(src[x * 3 + 1]);
+        dst[x * 4 + 2] = intToFloat<numVals>(src[x * 3 + 2]);
+        dst[x * 4 + 3] = 0.f;
+    }
+}
+
+// Convert the render window from the decoded buffer of width*height RGB pixels, whose first row is the top of the frame.
+template<typename PIX, int numVals, int nComponents>
 static void
 fillWindow(const unsigned char* buffer,
+           int width,
+           int height,
            const OfxRectI& renderWindow,
            float *pixelData,
            const OfxRectI& imgBounds,
@@ -199,22 +284,18 @@ fillWindow(const unsigned char* buffer,
            (nComponents == 4 && pixelComponents == OFX::ePixelComponentRGBA));
     ///fill the renderWindow in dstImg with the buffer freshly decoded.
     for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
-        int srcY = renderWindow.y2 - y - 1;
-        float* dst_pixels = (float*)((char*)pixelData + rowBytes*(y-imgBounds.y1));
-        const unsigned char* src_pixels = buffer + (imgBounds.x2 - imgBounds.x1) * srcY * 3;
-
-        for (int x = renderWindow.x1; x < renderWindow.x2; ++x) {
-            int srcCol = x * 3;
-            int dstCol = x * nComponents;
-            dst_pixels[dstCol + 0] = intToFloat<256>(src_pixels[srcCol + 0]);
-            dst_pixels[dstCol + 1] = intToFloat<256>(src_pixels[srcCol + 1]);
-            dst_pixels[dstCol + 2] = intToFloat<256>(src_pixels[srcCol + 2]);
-            if (nComponents == 4) {
-                // Output is Opaque with alpha=0 by default,
-                // but premultiplication is set to opaque.
-                // That way, chaining with a Roto node works correctly.
-                dst_pixels[dstCol + 3] = 0.f;
-            }
+        int srcY = height - y - 1;
+        float* dst_pixels = (float*)((char*)pixelData + rowBytes*(y-imgBounds.y1)) + (renderWindow.x1 - imgBounds.x1) * nComponents;
+        const PIX* src_pixels = (const PIX*)buffer + ((size_t)width * srcY + renderWindow.x1) * 3;
+
+        if (nComponents == 3) {
+            // the components are in the same order
+            componentsToFloat<PIX, numVals>(src_pixels, (renderWindow.x2 - renderWindow.x1) * 3, dst_pixels);
+        } else {
+            // Output is Opaque with alpha=0 by default,
+            // but premultiplication is set to opaque.
+            // That way, chaining with a Roto node works correctly.
+            rgbToRGBAFloat<PIX, numVals>(src_pixels, renderWindow.x2 - renderWindow.x1, dst_pixels);
         }
     }
 }
@@ -228,32 +309,53 @@ ReadFFmpegPlugin::decode(const std::string& filename,
                          OFX::PixelComponentEnum pixelComponents,
                          int rowBytes)
 {
-    if (_ffmpegFile && filename != _ffmpegFile->getFilename()) {
-        _ffmpegFile->open(filename);
-    } else if (!_ffmpegFile) {
-        return;
-    }
-    if (!_ffmpegFile->isValid()) {
-        setPersistentMessage(OFX::Message::eMessageError, "", _ffmpegFile->getError());
-        return;
-    }
+    decodeMipmapLevel(filename, time, 0, renderWindow, pixelData, imgBounds, pixelComponents, rowBytes);
+}
 
+unsigned int
+ReadFFmpegPlugin::getFileMipmapLevel(const std::string& /*filename*/,
+                                     OfxTime /*time*/,
+                                     unsigned int level)
+{
+    // frames are decoded at a reduced resolution if the codec supports it, and converted directly to the render scale
+    return level;
+}
+
+void
+ReadFFmpegPlugin::decodeMipmapLevel(const std::string& filename,
+                                    OfxTime time,
+                                    unsigned int level,
+                                    const OfxRectI& renderWindow,
+                                    float *pixelData,
+                                    const OfxRectI& imgBounds,
+                                    OFX::PixelComponentEnum pixelComponents,
+                                    int rowBytes)
+{
     /// we only support RGB or RGBA output clip
     if ((pixelComponents != OFX::ePixelComponentRGB) &&
         (pixelComponents != OFX::ePixelComponentRGBA)) {
         OFX::throwSuiteStatusException(kOfxStatErrFormat);
     }
 
-    ///blindly ignore the filename, we suppose that the file is the same than the file loaded in the changedParam
-    if (!_ffmpegFile) {
-        setPersistentMessage(OFX::Message::eMessageError, "",filename +  ": Missing frame");
-        OFX::throwSuiteStatusException(kOfxStatFailed);
+    bool fastScrub = false;
+    if (level > 0) {
+        _fastScrub->getValue(fastScrub);
+    }
+    
+    // check out a decoder from the pool, so that other threads can decode other frames of the same file
+    int frame = (int)std::floor(time + 0.5);
+    FFmpeg::FileLocker decoder(filename, frame, std::min((int)level, kMaxLowres), fastScrub);
+    if (!decoder->isValid()) {
+        setPersistentMessage(OFX::Message::eMessageError, "", decoder->getError());
         return;
     }
     
     int width,height,frames;
     double ap;
-    _ffmpegFile->getInfo(width, height, ap, frames);
+    decoder->getInfo(width, height, ap, frames);
+    // the size of the mipmap level, see downscalePowerOfTwoSmallestEnclosing()
+    width = (width + (1 << level) - 1) >> level;
+    height = (height + (1 << level) - 1) >> level;
 
     // wrong assert:
     // http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#kOfxImageEffectPropSupportsTiles
@@ -272,25 +374,24 @@ ReadFFmpegPlugin::decode(const std::string& filename,
     // see http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#kOfxImagePropPixelAspectRatio
     //dstImg->getPropertySet().propSetDouble(kOfxImagePropPixelAspectRatio, ap, 0);
     
-    if (_bufferWidth != width || _bufferHeight != height){
-        delete [] _buffer;
-        _buffer = 0;
-    }
-    
-    if (!_buffer){
-        _buffer = new unsigned char[width * height * 3];
-        _bufferHeight = height;
-        _bufferWidth = width;
-    }
+    // deep sources are decoded to 16 bits per component
+    int bytesPerComponent = decoder->getBytesPerComponent();
+    std::vector<unsigned char> buffer((size_t)width * height * 3 * bytesPerComponent);
     
     
     int maxRetries;
     _maxRetries->getValue(maxRetries);
     
     try {
-        if ( !_ffmpegFile->decode(_buffer, std::floor(time+0.5), loadNearestFrame(), maxRetries) ) {
+        bool decoded;
+        if (fastScrub) {
+            decoded = decoder->decodeKeyFrame(&buffer[0], frame, width, height);
+        } else {
+            decoded = decoder->decode(&buffer[0], frame, loadNearestFrame(), maxRetries, width, height);
+        }
+        if (!decoded) {
             
-            setPersistentMessage(OFX::Message::eMessageError, "", _ffmpegFile->getError());
+            setPersistentMessage(OFX::Message::eMessageError, "", decoder->getError());
             OFX::throwSuiteStatusException(kOfxStatFailed);
             
         }
@@ -305,10 +406,18 @@ ReadFFmpegPlugin::decode(const std::string& filename,
     }
 
     ///fill the renderWindow in dstImg with the buffer freshly decoded.
-    if (pixelComponents == OFX::ePixelComponentRGB) {
-        fillWindow<3>(_buffer, renderWindow, pixelData, imgBounds, pixelComponents, rowBytes);
-    } else if (pixelComponents == OFX::ePixelComponentRGBA) {
-        fillWindow<4>(_buffer, renderWindow, pixelData, imgBounds, pixelComponents, rowBytes);
+    if (bytesPerComponent == 2) {
+        if (pixelComponents == OFX::ePixelComponentRGB) {
+            fillWindow<unsigned short, 65536, 3>(&buffer[0], width, height, renderWindow, pixelData, imgBounds, pixelComponents, rowBytes);
+        } else if (pixelComponents == OFX::ePixelComponentRGBA) {
+            fillWindow<unsigned short, 65536, 4>(&buffer[0], width, height, renderWindow, pixelData, imgBounds, pixelComponents, rowBytes);
+        }
+    } else {
+        if (pixelComponents == OFX::ePixelComponentRGB) {
+            fillWindow<unsigned char, 256, 3>(&buffer[0], width, height, renderWindow, pixelData, imgBounds, pixelComponents, rowBytes);
+        } else if (pixelComponents == OFX::ePixelComponentRGBA) {
+            fillWindow<unsigned char, 256, 4>(&buffer[0], width, height, renderWindow, pixelData, imgBounds, pixelComponents, rowBytes);
+        }
     }
 }
 
@@ -323,6 +432,7 @@ bool ReadFFmpegPlugin::getSequenceTimeDomain(const std::string& filename,OfxRang
         int width,height,frames;
         double ap;
         if (_ffmpegFile) {
+            OFX::MultiThread::AutoMutex guard(_ffmpegFileLock);
             
             if (_ffmpegFile->getFilename() != filename) {
                 _ffmpegFile->close();
@@ -349,6 +459,7 @@ ReadFFmpegPlugin::getFrameRate(const std::string& filename, double* fps) const
 {
     assert(fps);
     
+    OFX::MultiThread::AutoMutex guard(_ffmpegFileLock);
     if (_ffmpegFile && filename != _ffmpegFile->getFilename()) {
         _ffmpegFile->open(filename);
     } else if (!_ffmpegFile) {
@@ -374,7 +485,7 @@ ReadFFmpegPlugin::getFrameBounds(const std::string& filename,
                                  std::string *error)
 {
     assert(bounds && par);
-    ///blindly ignore the filename, we suppose that the file is the same than the file loaded in the changedParam
+    OFX::MultiThread::AutoMutex guard(_ffmpegFileLock);
     if (_ffmpegFile && filename != _ffmpegFile->getFilename()) {
         _ffmpegFile->open(filename);
     } else if (!_ffmpegFile) {
@@ -412,7 +523,7 @@ ReadFFmpegPlugin::getFrameBounds(const std::string& filename,
 
 using namespace OFX;
 
-mDeclareReaderPluginFactory(ReadFFmpegPluginFactory, {}, {},true);
+mDeclareReaderPluginFactory(ReadFFmpegPluginFactory, { FFmpeg::FileManager::s_readerManager.initialize(); }, {},true);
 
 static std::string ffmpeg_versions()
 {
@@ -560,7 +671,8 @@ ReadFFmpegPluginFactory::describe(OFX::ImageEffectDescriptor &desc)
     desc.setPluginEvaluation(0);
 #endif
     
-    desc.setRenderThreadSafety(OFX::eRenderInstanceSafe);
+    // frames are decoded by a pool of decoders
+    desc.setRenderThreadSafety(OFX::eRenderFullySafe);
     
   
     
@@ -585,6 +697,14 @@ ReadFFmpegPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
         param->setDisplayRange(0, 20);
         page->addChild(*param);
     }
+    {
+        OFX::BooleanParamDescriptor *param = desc.defineBooleanParam(kFastScrubParamName);
+        param->setLabels(kFastScrubParamLabel, kFastScrubParamLabel, kFastScrubParamLabel);
+        param->setHint(kFastScrubParamHint);
+        param->setAnimates(false);
+        param->setDefault(false);
+        page->addChild(*param);
+    }
 
     GenericReaderDescribeInContextEnd(desc, context, page, "rec709", "reference");
 }
@@ -47,7 +47,11 @@
 #include "WriteFFmpeg.h"
 
 #include <cstdio>
+#include <cstdlib>
 #include <sstream>
+#include <vector>
+#include <list>
+#include <algorithm>
 
 #if _WIN32
 #define snprintf sprintf_s
@@ -55,8 +59,10 @@
 
 #if defined(_WIN32) || defined(WIN64)
 #  include <windows.h> // for GetSystemInfo()
+#  include <process.h> // for _beginthreadex()
 #else
 #  include <unistd.h> // for sysconf()
+#  include <pthread.h>
 #endif
 
 extern "C" {
@@ -70,8 +76,14 @@ extern "C" {
 #include <libavutil/avutil.h>
 #include <libavutil/error.h>
 #include <libavutil/mathematics.h>
+#include <libavutil/pixdesc.h>
 }
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OFX_IO_FFMPEG_HAS_SSE2
+#endif
 #include "FFmpegCompat.h"
+#include "FFmpegHandler.h"
 #include "IOUtility.h"
 
 #include "GenericWriter.h"
@@ -87,10 +99,107 @@ extern "C" {
 #define kSupportsRGB true
 #define kSupportsAlpha false
 
+// the number of converted frames which may wait for the encoder thread
+#define kEncodeQueueSize 4
+// memory used by the converted frames waiting for the encoders, in megabytes. When segments are encoded in parallel,
+// the frames of the following segments are kept until this budget is used up, then the render waits for the encoders.
+#define kEncodeMemoryEnv "OFX_IO_FFMPEG_ENCODE_MEMORY_MB"
+#define kEncodeMemoryDefault 2048
+
+// the format of the temporary segment files, which can store any codec
+#define kSegmentFormat "nut"
+
 struct AVCodecContext;
 struct AVFormatContext;
 struct AVStream;
 
+class WriteFFmpegPlugin;
+
+// An encoder with its thread, writing either to the output file or to a temporary segment file.
+struct EncodeSegment
+{
+    WriteFFmpegPlugin* plugin;
+    AVFormatContext* formatContext;
+    AVStream* stream;
+    AVCodecContext* codecContext;
+    std::string filename; //< the temporary segment file, empty if the segment is the output file
+    uint8_t* outputBuffer; //< the packet buffer for avcodec_encode_video
+    int outputBufferSize;
+#if defined(_WIN32) || defined(WIN64)
+    void* thread;
+#else
+    pthread_t thread;
+#endif
+    bool threadRunning; //< only accessed by the render thread
+    std::list<AVFrame*> queuedFrames; //< protected by the plugin's _queueCondition
+    bool stop; //< protected by the plugin's _queueCondition
+
+    EncodeSegment()
+    : plugin(0)
+    , formatContext(0)
+    , stream(0)
+    , codecContext(0)
+    , filename()
+    , outputBuffer(0)
+    , outputBufferSize(0)
+    , thread()
+    , threadRunning(false)
+    , queuedFrames()
+    , stop(false)
+    {
+    }
+};
+
+// A mutex with a condition variable, used to wait on the frames queue of the encoder thread
+// (OFX::MultiThread has no condition variables).
+class EncodeQueueCondition
+{
+public:
+    EncodeQueueCondition()
+    {
+#if defined(_WIN32) || defined(WIN64)
+        InitializeCriticalSection(&_mutex);
+        InitializeConditionVariable(&_cond);
+#else
+        pthread_mutex_init(&_mutex, NULL);
+        pthread_cond_init(&_cond, NULL);
+#endif
+    }
+
+    ~EncodeQueueCondition()
+    {
+#if defined(_WIN32) || defined(WIN64)
+        DeleteCriticalSection(&_mutex);
+#else
+        pthread_cond_destroy(&_cond);
+        pthread_mutex_destroy(&_mutex);
+#endif
+    }
+
+#if defined(_WIN32) || defined(WIN64)
+    void lock() { EnterCriticalSection(&_mutex); }
+    void unlock() { LeaveCriticalSection(&_mutex); }
+    // must be called with the mutex locked
+    void wait() { SleepConditionVariableCS(&_cond, &_mutex, INFINITE); }
+    void broadcast() { WakeAllConditionVariable(&_cond); }
+#else
+    void lock() { pthread_mutex_lock(&_mutex); }
+    void unlock() { pthread_mutex_unlock(&_mutex); }
+    // must be called with the mutex locked
+    void wait() { pthread_cond_wait(&_cond, &_mutex); }
+    void broadcast() { pthread_cond_broadcast(&_cond); }
+#endif
+
+private:
+#if defined(_WIN32) || defined(WIN64)
+    CRITICAL_SECTION _mutex;
+    CONDITION_VARIABLE _cond;
+#else
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+#endif
+};
+
 class WriteFFmpegPlugin : public GenericWriterPlugin
 {
 public:
@@ -120,6 +229,50 @@ private:
 
     void freeFormat();
     
+    // enable the parameters which are supported by the selected codec and mode
+    void updateCodecParams();
+    
+    // encode a frame and write its packets. Called by the encoder thread.
+    int encodeFrame(EncodeSegment* segment, AVFrame* frame);
+    
+    // write the packets still in the encoder. Called by the encoder thread.
+    int flushEncoder(EncodeSegment* segment);
+    
+    // start the encoder thread of a segment, which encodes its queued frames until stop is set and the queue is empty
+    bool startSegment(EncodeSegment* segment);
+    
+    // open an encoder writing to a new temporary segment file, and start its thread. Returns NULL on failure.
+    EncodeSegment* createSegment(int index);
+    
+    // wait for the encoder thread of a segment to encode the queued frames and flush the encoder, close the
+    // segment file and delete the segment. Returns the first encoding error.
+    int finishSegment(EncodeSegment* segment);
+    
+    // finish all the segments being encoded
+    int finishSegments();
+    
+    // remux the finished segment files into the output file, without re-encoding
+    int concatenateSegments();
+    
+    void removeSegmentFiles();
+    
+    void encodeQueuedFrames(EncodeSegment* segment);
+    
+#if defined(_WIN32) || defined(WIN64)
+    static unsigned __stdcall encoderThreadMain(void* segment);
+#else
+    static void* encoderThreadMain(void* segment);
+#endif
+    
+    // Allocate the picture used by encode, once the codec is opened. The frames are allocated by encode when needed, up
+    // to maxFrames and the memory budget.
+    bool allocateConversion(int maxFrames);
+    
+    // a new frame in the codec pixel format, or NULL if none can be allocated
+    AVFrame* allocateFrame();
+    
+    void freeConversion();
+    
     
     ///These members are not protected and only read/written by/to by the same thread.
     AVCodecContext*   _codecContext;
@@ -127,6 +280,28 @@ private:
     AVStream* _stream;
     int _lastTimeEncoded; //< the frame index of the last frame encoded.
 
+    // reused for all the frames of the sequence
+    FFmpeg::SliceConverter _converter; //< converts _rgbPicture to the codec pixel format, in parallel bands
+    PixelFormat _rgbPixelFormat; //< PIX_FMT_RGB48 if the codec pixel format has more than 8 bits per component, else PIX_FMT_RGB24
+    AVPicture _rgbPicture;
+    bool _rgbPictureAllocated;
+    std::vector<AVFrame*> _frames; //< the frames in the codec pixel format, either free or queued
+    int _maxFrames; //< the maximum number of frames, from the number of segments and the memory budget
+    std::vector<int> _rowBuffer; //< a row of quantized components
+    
+    // render() converts the images to free frames and queues them to the last segment, the encoder threads
+    // of the segments encode the queued frames and write the packets.
+    // Without segment-parallel encoding, there is a single segment which writes to the output file.
+    EncodeQueueCondition _queueCondition;
+    std::list<AVFrame*> _freeFrames; //< protected by _queueCondition
+    int _encoderError; //< the first error of the encoder threads, 0 if none. Protected by _queueCondition
+    std::list<EncodeSegment*> _segments; //< the segments being encoded, only accessed by the render thread
+    std::vector<std::string> _segmentFiles; //< the finished segment files, in order
+    int _parallelSegments; //< the maximum number of segments encoded at the same time
+    int _segmentLength; //< the number of frames of a segment, 0 without segment-parallel encoding
+    int64_t _framesQueued; //< the pts of the next frame, only accessed by the render thread
+    AVDictionary* _codecOptions; //< the codec private options, to open the segment encoders
+
     OFX::ChoiceParam* _format;
     OFX::DoubleParam* _fps;
 
@@ -136,6 +311,13 @@ private:
     OFX::IntParam* _gopSize;
     OFX::IntParam* _bFrames;
     OFX::ChoiceParam* _macroBlockDecision;
+    OFX::ChoiceParam* _threadType;
+    OFX::ChoiceParam* _preset;
+    OFX::IntParam* _crf;
+    OFX::ChoiceParam* _pixelFormat;
+    OFX::ChoiceParam* _profile;
+    OFX::IntParam* _parallelSegmentsParam;
+    OFX::IntParam* _segmentLengthParam;
 
 };
 
@@ -150,6 +332,114 @@ private:
 #define kParamBFrames "bframes"
 #define kParamMBDecision "mbDecision"
 
+#define kParamThreadType "threadType"
+#define kParamThreadTypeLabel "Threading"
+#define kParamThreadTypeHint "How the encoder uses several threads. Frame threading encodes several frames in parallel and scales better, " \
+"but delays the output by a few frames. Slice threading splits each frame into slices."
+#define kParamThreadTypeOptionFrameSlice "Frame and slice"
+#define kParamThreadTypeOptionFrame "Frame"
+#define kParamThreadTypeOptionSlice "Slice"
+#define kParamThreadTypeOptionNone "None"
+enum ThreadTypeEnum {
+    eThreadTypeFrameSlice = 0,
+    eThreadTypeFrame,
+    eThreadTypeSlice,
+    eThreadTypeNone,
+};
+
+#define kParamPreset "preset"
+#define kParamPresetLabel "Preset"
+#define kParamPresetHint "Encoding speed to compression ratio tradeoff of the codec (e.g. libx264, libx265). Slower presets give smaller files at the same quality."
+
+#define kParamCRF "crf"
+#define kParamCRFLabel "Constant rate factor"
+#define kParamCRFHint "Constant quality encoding for the codecs which support it (e.g. libx264, libx265): lower values give a higher quality. " \
+"-1 uses the bitrate instead."
+
+#define kParamPixelFormat "pixelFormat"
+#define kParamPixelFormatLabel "Pixel format"
+#define kParamPixelFormatHint "The pixel format of the encoded video. Default uses the first pixel format supported by the codec. " \
+"10-bit formats keep more precision, if the codec supports them."
+
+#define kParamProfile "profile"
+#define kParamProfileLabel "Intra-only profile"
+#define kParamProfileHint "Encode with an intra-only codec profile, where every frame is a key frame, which gives the fastest random access " \
+"when the movie is read. This overrides the codec, the pixel format and the GOP size."
+
+#define kParamParallelSegments "parallelSegments"
+#define kParamParallelSegmentsLabel "Parallel segments"
+#define kParamParallelSegmentsHint "When greater than 1, the sequence is split into segments starting with a closed GOP, which are encoded in parallel " \
+"by this number of encoders into temporary files next to the output file, and concatenated without re-encoding at the end. " \
+"The processors are shared between the encoders. The frames of the segments being encoded are kept in memory, up to " \
+"2048MB by default (set the " kEncodeMemoryEnv " environment variable to change it), after which rendering waits for the encoders."
+
+#define kParamSegmentLength "segmentLength"
+#define kParamSegmentLengthLabel "Segment length"
+#define kParamSegmentLengthHint "The number of frames of a segment when encoding segments in parallel, rounded up to a multiple of the GOP size."
+
+// the choices of the pixel format param
+static const PixelFormat kPixelFormats[] = {
+    PIX_FMT_NONE,
+    PIX_FMT_YUV420P,
+    PIX_FMT_YUV422P,
+    PIX_FMT_YUV444P,
+    PIX_FMT_YUV420P10,
+    PIX_FMT_YUV422P10,
+    PIX_FMT_YUV444P10,
+};
+static const char* const kPixelFormatLabels[] = {
+    "Default",
+    "YUV 4:2:0 8-bit",
+    "YUV 4:2:2 8-bit",
+    "YUV 4:4:4 8-bit",
+    "YUV 4:2:0 10-bit",
+    "YUV 4:2:2 10-bit",
+    "YUV 4:4:4 10-bit",
+};
+
+static const char* const kPresets[] = {
+    "ultrafast", "superfast", "veryfast", "faster", "fast", "medium", "slow", "slower", "veryslow", "placebo",
+};
+
+struct IntraProfile
+{
+    const char* label;
+    const char* codec;   // encoder name
+    const char* profile; // value of the encoder's "profile" option, or NULL
+    PixelFormat pixelFormat;
+};
+
+// the choices of the profile param, after "None"
+static const IntraProfile kIntraProfiles[] = {
+    { "ProRes 422 Proxy", "prores_ks", "proxy",     PIX_FMT_YUV422P10 },
+    { "ProRes 422 LT",    "prores_ks", "lt",        PIX_FMT_YUV422P10 },
+    { "ProRes 422",       "prores_ks", "standard",  PIX_FMT_YUV422P10 },
+    { "ProRes 422 HQ",    "prores_ks", "hq",        PIX_FMT_YUV422P10 },
+    { "ProRes 4444",      "prores_ks", "4444",      PIX_FMT_YUV444P10 },
+    { "DNxHR LB",         "dnxhd",     "dnxhr_lb",  PIX_FMT_YUV422P },
+    { "DNxHR SQ",         "dnxhd",     "dnxhr_sq",  PIX_FMT_YUV422P },
+    { "DNxHR HQ",         "dnxhd",     "dnxhr_hq",  PIX_FMT_YUV422P },
+    { "DNxHR HQX",        "dnxhd",     "dnxhr_hqx", PIX_FMT_YUV422P10 },
+    { "DNxHR 444",        "dnxhd",     "dnxhr_444", PIX_FMT_YUV444P10 },
+    { "Motion JPEG",      "mjpeg",     NULL,        PIX_FMT_YUVJ422P },
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+// true if the encoder has the given private option (e.g. "preset" or "crf")
+static bool codecHasOption(const AVCodec* codec, const char* name)
+{
+    return codec && codec->priv_class && av_opt_find((void*)&codec->priv_class, name, NULL, 0, AV_OPT_SEARCH_FAKE_OBJ) != NULL;
+}
+
+static void freeFormatContext(AVFormatContext* formatContext)
+{
+    for (int i = 0; i < static_cast<int>(formatContext->nb_streams); ++i){
+        av_freep(&formatContext->streams[i]);
+    }
+    av_free(formatContext);
+}
+
 
 
 class FFmpegSingleton {
@@ -223,9 +513,7 @@ FFmpegSingleton::~FFmpegSingleton(){
     
 }
 
-// Use one decoding thread per processor for video decoding.
-// source: http://git.savannah.gnu.org/cgit/bino.git/tree/src/media_object.cpp
-static int video_decoding_threads()
+static int number_of_processors()
 {
     static long n = -1;
     if (n < 0) {
@@ -238,13 +526,18 @@ static int video_decoding_threads()
 #endif
         if (n < 1) {
             n = 1;
-        } else if (n > 16) {
-            n = 16;
         }
     }
     return n;
 }
 
+// Use one decoding thread per processor for video decoding.
+// source: http://git.savannah.gnu.org/cgit/bino.git/tree/src/media_object.cpp
+static int video_decoding_threads()
+{
+    return std::min(number_of_processors(), 16);
+}
+
 using namespace OFX;
 
 WriteFFmpegPlugin::WriteFFmpegPlugin(OfxImageEffectHandle handle)
@@ -253,6 +546,22 @@ WriteFFmpegPlugin::WriteFFmpegPlugin(OfxImageEffectHandle handle)
 , _formatContext(0)
 , _stream(0)
 , _lastTimeEncoded(-1)
+, _converter()
+, _rgbPixelFormat(PIX_FMT_RGB24)
+, _rgbPicture()
+, _rgbPictureAllocated(false)
+, _frames()
+, _maxFrames(0)
+, _rowBuffer()
+, _queueCondition()
+, _freeFrames()
+, _encoderError(0)
+, _segments()
+, _segmentFiles()
+, _parallelSegments(1)
+, _segmentLength(0)
+, _framesQueued(0)
+, _codecOptions(0)
 , _format(0)
 , _fps(0)
 , _codec(0)
@@ -261,6 +570,13 @@ WriteFFmpegPlugin::WriteFFmpegPlugin(OfxImageEffectHandle handle)
 , _gopSize(0)
 ,_bFrames(0)
 , _macroBlockDecision(0)
+, _threadType(0)
+, _preset(0)
+, _crf(0)
+, _pixelFormat(0)
+, _profile(0)
+, _parallelSegmentsParam(0)
+, _segmentLengthParam(0)
 {
     _format = fetchChoiceParam(kParamFormat);
     _fps = fetchDoubleParam(kParamFPS);
@@ -270,16 +586,57 @@ WriteFFmpegPlugin::WriteFFmpegPlugin(OfxImageEffectHandle handle)
     _gopSize = fetchIntParam(kParamGop);
     _bFrames = fetchIntParam(kParamBFrames);
     _macroBlockDecision = fetchChoiceParam(kParamMBDecision);
+    _threadType = fetchChoiceParam(kParamThreadType);
+    _preset = fetchChoiceParam(kParamPreset);
+    _crf = fetchIntParam(kParamCRF);
+    _pixelFormat = fetchChoiceParam(kParamPixelFormat);
+    _profile = fetchChoiceParam(kParamProfile);
+    _parallelSegmentsParam = fetchIntParam(kParamParallelSegments);
+    _segmentLengthParam = fetchIntParam(kParamSegmentLength);
+    
+    updateCodecParams();
 }
 
 WriteFFmpegPlugin::~WriteFFmpegPlugin(){
-    
+    finishSegments();
+    removeSegmentFiles();
+    freeConversion();
+    av_dict_free(&_codecOptions);
 }
 
 void WriteFFmpegPlugin::changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName){
+    if (paramName == kParamCodec || paramName == kParamProfile || paramName == kParamParallelSegments) {
+        updateCodecParams();
+    }
     GenericWriterPlugin::changedParam(args, paramName);
 }
 
+void WriteFFmpegPlugin::updateCodecParams()
+{
+    // the codec is only known if it is selected, else it depends on the format
+    const AVCodec* codec = NULL;
+    int profile;
+    _profile->getValue(profile);
+    if (profile > 0 && profile <= (int)ARRAY_SIZE(kIntraProfiles)) {
+        codec = avcodec_find_encoder_by_name(kIntraProfiles[profile - 1].codec);
+    } else {
+        int codecValue;
+        _codec->getValue(codecValue);
+        const std::vector<std::string>& codecShortNames = FFmpegSingleton::Instance().getCodecsShortNames();
+        if (codecValue > 0 && codecValue < (int)codecShortNames.size()) {
+            codec = avcodec_find_encoder_by_name(codecShortNames[codecValue].c_str());
+        }
+    }
+    _preset->setEnabled(!codec || codecHasOption(codec, "preset"));
+    _crf->setEnabled(!codec || codecHasOption(codec, "crf"));
+    _codec->setEnabled(profile == 0);
+    _pixelFormat->setEnabled(profile == 0);
+    _gopSize->setEnabled(profile == 0);
+    int parallelSegments;
+    _parallelSegmentsParam->getValue(parallelSegments);
+    _segmentLengthParam->setEnabled(parallelSegments > 1);
+}
+
 
 bool WriteFFmpegPlugin::isImageFile(const std::string& ext) const{
     return ext == "bmp" ||
@@ -299,6 +656,14 @@ bool WriteFFmpegPlugin::isImageFile(const std::string& ext) const{
 
 
 
+#define checkAvError() if (error < 0) { \
+                        char errorBuf[1024]; \
+                        av_strerror(error, errorBuf, sizeof(errorBuf)); \
+                        setPersistentMessage(OFX::Message::eMessageError, "", errorBuf); \
+                        OFX::throwSuiteStatusException(kOfxStatFailed); \
+                    }
+
+
 void WriteFFmpegPlugin::beginEncode(const std::string& filename,const OfxRectI& rod,const OFX::BeginSequenceRenderArguments& args)
 {
     if (!args.sequentialRenderStatus || _formatContext || _stream) {
@@ -365,7 +730,23 @@ void WriteFFmpegPlugin::beginEncode(const std::string& filename,const OfxRectI&
         }
     }
     
-    AVCodec* videoCodec = avcodec_find_encoder(codecId);
+    // an intra-only profile overrides the codec
+    int profile;
+    _profile->getValue(profile);
+    const IntraProfile* intraProfile = NULL;
+    if (profile > 0 && profile <= (int)ARRAY_SIZE(kIntraProfiles)) {
+        intraProfile = &kIntraProfiles[profile - 1];
+        AVCodec* profileCodec = avcodec_find_encoder_by_name(intraProfile->codec);
+        if (!profileCodec) {
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("The ") + intraProfile->codec + " encoder is not available");
+            freeFormat();
+            throwSuiteStatusException(kOfxStatFailed);
+            return;
+        }
+        codecId = profileCodec->id;
+    }
+    
+    AVCodec* videoCodec = intraProfile ? avcodec_find_encoder_by_name(intraProfile->codec) : avcodec_find_encoder(codecId);
     if (!videoCodec) {
         setPersistentMessage(OFX::Message::eMessageError, "","Unable to find codec");
         freeFormat();
@@ -382,6 +763,28 @@ void WriteFFmpegPlugin::beginEncode(const std::string& filename,const OfxRectI&
             pixFMT = PIX_FMT_RGB24;
         }
     }
+    
+    int pixelFormatValue;
+    _pixelFormat->getValue(pixelFormatValue);
+    PixelFormat userPixFMT = PIX_FMT_NONE;
+    if (intraProfile) {
+        userPixFMT = intraProfile->pixelFormat;
+    } else if (pixelFormatValue > 0 && pixelFormatValue < (int)ARRAY_SIZE(kPixelFormats)) {
+        userPixFMT = kPixelFormats[pixelFormatValue];
+    }
+    if (userPixFMT != PIX_FMT_NONE) {
+        bool supported = (videoCodec->pix_fmts == NULL);
+        for (const PixelFormat* p = videoCodec->pix_fmts; p && *p != PIX_FMT_NONE; ++p) {
+            supported |= (*p == userPixFMT);
+        }
+        if (!supported) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "The selected pixel format is not supported by the codec");
+            freeFormat();
+            throwSuiteStatusException(kOfxStatFailed);
+            return;
+        }
+        pixFMT = userPixFMT;
+    }
 
     
     bool isCodecSupportedInContainer = (avformat_query_codec(fmt, codecId, FF_COMPLIANCE_NORMAL) == 1);
@@ -445,7 +848,23 @@ void WriteFFmpegPlugin::beginEncode(const std::string& filename,const OfxRectI&
     
     int gopSize;
     _gopSize->getValue(gopSize);
-    _codecContext->gop_size = gopSize;
+    // a GOP size of 0 means intra-only
+    _codecContext->gop_size = intraProfile ? 0 : gopSize;
+    
+    // segment-parallel encoding: each segment is encoded by its own encoder, starting with a closed GOP
+    _parallelSegmentsParam->getValue(_parallelSegments);
+    _parallelSegments = std::max(1, _parallelSegments);
+    _segmentLength = 0;
+    if (_parallelSegments > 1 && !(fmt->flags & (AVFMT_NOFILE | AVFMT_RAWPICTURE)) && av_guess_format(kSegmentFormat, NULL, NULL)) {
+        _segmentLengthParam->getValue(_segmentLength);
+        _segmentLength = std::max(1, _segmentLength);
+        if (_codecContext->gop_size > 1) {
+            _segmentLength = ((_segmentLength + _codecContext->gop_size - 1) / _codecContext->gop_size) * _codecContext->gop_size;
+        }
+        _codecContext->flags |= CODEC_FLAG_CLOSED_GOP;
+    } else {
+        _parallelSegments = 1;
+    }
     
     int bFrames;
     _bFrames->getValue(bFrames);
@@ -471,6 +890,26 @@ void WriteFFmpegPlugin::beginEncode(const std::string& filename,const OfxRectI&
         // Activate multithreaded decoding. This must be done before opening the codec; see
         // http://lists.gnu.org/archive/html/bino-list/2011-08/msg00019.html
         _codecContext->thread_count = video_decoding_threads();
+        if (_parallelSegments > 1) {
+            // share the processors between the segment encoders
+            _codecContext->thread_count = std::max(1, number_of_processors() / _parallelSegments);
+        }
+        int threadType;
+        _threadType->getValue(threadType);
+        switch ((ThreadTypeEnum)threadType) {
+            case eThreadTypeFrameSlice:
+                _codecContext->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+                break;
+            case eThreadTypeFrame:
+                _codecContext->thread_type = FF_THREAD_FRAME;
+                break;
+            case eThreadTypeSlice:
+                _codecContext->thread_type = FF_THREAD_SLICE;
+                break;
+            case eThreadTypeNone:
+                _codecContext->thread_count = 1;
+                break;
+        }
         // Set CODEC_FLAG_EMU_EDGE in the same situations in which ffplay sets it.
         // I don't know what exactly this does, but it is necessary to fix the problem
         // described in this thread: http://lists.nongnu.org/archive/html/bino-list/2012-02/msg00039.html
@@ -481,7 +920,31 @@ void WriteFFmpegPlugin::beginEncode(const std::string& filename,const OfxRectI&
         if (lowres || (videoCodec && (videoCodec->capabilities & CODEC_CAP_DR1)))
             _codecContext->flags |= CODEC_FLAG_EMU_EDGE;
     }
-    if (avcodec_open2(_codecContext, videoCodec, NULL) < 0) {
+    
+    // the codec private options. Those which are not supported by the codec are ignored.
+    AVDictionary* codecOptions = NULL;
+    if (intraProfile && intraProfile->profile) {
+        av_dict_set(&codecOptions, "profile", intraProfile->profile, 0);
+    }
+    int preset;
+    _preset->getValue(preset);
+    if (preset > 0 && preset <= (int)ARRAY_SIZE(kPresets) && codecHasOption(videoCodec, "preset")) {
+        av_dict_set(&codecOptions, "preset", kPresets[preset - 1], 0);
+    }
+    int crf;
+    _crf->getValue(crf);
+    if (crf >= 0 && codecHasOption(videoCodec, "crf")) {
+        char crfStr[16];
+        snprintf(crfStr, sizeof(crfStr), "%d", crf);
+        av_dict_set(&codecOptions, "crf", crfStr, 0);
+    }
+    
+    av_dict_free(&_codecOptions);
+    av_dict_copy(&_codecOptions, codecOptions, 0);
+    
+    int openError = avcodec_open2(_codecContext, videoCodec, &codecOptions);
+    av_dict_free(&codecOptions);
+    if (openError < 0) {
         setPersistentMessage(OFX::Message::eMessageError,"" ,"Unable to open codec");
         freeFormat();
         throwSuiteStatusException(kOfxStatFailed);
@@ -495,7 +958,57 @@ void WriteFFmpegPlugin::beginEncode(const std::string& filename,const OfxRectI&
         }
     }
     
-    avformat_write_header(_formatContext, NULL);
+    // on the errors below, the output file is closed and removed, since it is incomplete
+    const bool hasFile = !(fmt->flags & AVFMT_NOFILE);
+    
+    if (avformat_write_header(_formatContext, NULL) < 0) {
+        setPersistentMessage(OFX::Message::eMessageError,"" ,"Unable to write the file header");
+        avcodec_close(_codecContext);
+        if (hasFile) {
+            avio_close(_formatContext->pb);
+            remove(filename.c_str());
+        }
+        freeFormat();
+        throwSuiteStatusException(kOfxStatFailed);
+    }
+    
+    if (!allocateConversion(kEncodeQueueSize + (_parallelSegments - 1) * _segmentLength)) {
+        setPersistentMessage(OFX::Message::eMessageError,"" ,"Out of memory");
+        avcodec_close(_codecContext);
+        if (hasFile) {
+            avio_close(_formatContext->pb);
+            remove(filename.c_str());
+        }
+        freeFormat();
+        throwSuiteStatusException(kOfxStatFailed);
+    }
+    
+    _queueCondition.lock();
+    _freeFrames.clear();
+    _encoderError = 0;
+    _queueCondition.unlock();
+    _framesQueued = 0;
+    
+    // in segment mode, the segments are created by encode(). Else a single encoder writes to the output file.
+    if (_segmentLength == 0) {
+        EncodeSegment* segment = new EncodeSegment;
+        segment->formatContext = _formatContext;
+        segment->stream = _stream;
+        segment->codecContext = _codecContext;
+        if (!startSegment(segment)) {
+            delete segment;
+            setPersistentMessage(OFX::Message::eMessageError,"" ,"Unable to start the encoder thread");
+            freeConversion();
+            avcodec_close(_codecContext);
+            if (hasFile) {
+                avio_close(_formatContext->pb);
+                remove(filename.c_str());
+            }
+            freeFormat();
+            throwSuiteStatusException(kOfxStatFailed);
+        }
+        _segments.push_back(segment);
+    }
     
     ///Flag that we didn't encode any frame yet
     _lastTimeEncoded = -1;
@@ -508,20 +1021,510 @@ void WriteFFmpegPlugin::endEncode(const OFX::EndSequenceRenderArguments &args)
     if (!_formatContext) {
         return;
     }
+    // encode the queued frames and the frames delayed by the encoders
+    int error = finishSegments();
+    if (error >= 0 && !_segmentFiles.empty()) {
+        error = concatenateSegments();
+    }
+    removeSegmentFiles();
     av_write_trailer(_formatContext);
     avcodec_close(_codecContext);
     if (!(_formatContext->oformat->flags & AVFMT_NOFILE)) {
         avio_close(_formatContext->pb);
     }
     freeFormat();
+    freeConversion();
+    av_dict_free(&_codecOptions);
+    checkAvError();
 }
 
-#define checkAvError() if (error < 0) { \
-                        char errorBuf[1024]; \
-                        av_strerror(error, errorBuf, sizeof(errorBuf)); \
-                        setPersistentMessage(OFX::Message::eMessageError, "", errorBuf); \
-                        OFX::throwSuiteStatusException(kOfxStatFailed); \
+bool WriteFFmpegPlugin::startSegment(EncodeSegment* segment)
+{
+    assert(!segment->threadRunning);
+    segment->plugin = this;
+#if LIBAVCODEC_VERSION_INT<AV_VERSION_INT(54,1,0)
+    segment->outputBufferSize = avpicture_get_size(segment->codecContext->pix_fmt, segment->codecContext->width, segment->codecContext->height);
+    segment->outputBuffer = (uint8_t*)av_malloc(segment->outputBufferSize);
+    if (!segment->outputBuffer) {
+        return false;
+    }
+#endif
+    _queueCondition.lock();
+    segment->queuedFrames.clear();
+    segment->stop = false;
+    _queueCondition.unlock();
+#if defined(_WIN32) || defined(WIN64)
+    segment->thread = (void*)_beginthreadex(NULL, 0, encoderThreadMain, segment, 0, NULL);
+    segment->threadRunning = (segment->thread != NULL);
+#else
+    segment->threadRunning = (pthread_create(&segment->thread, NULL, encoderThreadMain, segment) == 0);
+#endif
+    if (!segment->threadRunning && segment->outputBuffer) {
+        av_freep(&segment->outputBuffer);
+    }
+    return segment->threadRunning;
+}
+
+EncodeSegment* WriteFFmpegPlugin::createSegment(int index)
+{
+    char segmentFilename[4096];
+    snprintf(segmentFilename, sizeof(segmentFilename), "%s.segment%05d." kSegmentFormat, _formatContext->filename, index);
+    
+    AVOutputFormat* fmt = av_guess_format(kSegmentFormat, NULL, NULL);
+    AVFormatContext* formatContext = avformat_alloc_context();
+    if (!fmt || !formatContext) {
+        av_free(formatContext);
+        return NULL;
+    }
+    formatContext->oformat = fmt;
+    snprintf(formatContext->filename, sizeof(formatContext->filename), "%s", segmentFilename);
+    
+    AVStream* stream = avformat_new_stream(formatContext, NULL);
+    AVCodecContext* codecContext = stream ? stream->codec : NULL;
+    bool opened = false;
+    if (codecContext && avcodec_copy_context(codecContext, _codecContext) >= 0) {
+        // the extradata is created by the encoder
+        av_freep(&codecContext->extradata);
+        codecContext->extradata_size = 0;
+        AVDictionary* codecOptions = NULL;
+        av_dict_copy(&codecOptions, _codecOptions, 0);
+        opened = (avcodec_open2(codecContext, _codecContext->codec, &codecOptions) >= 0);
+        av_dict_free(&codecOptions);
+    }
+    if (!opened) {
+        freeFormatContext(formatContext);
+        return NULL;
+    }
+    if (avio_open(&formatContext->pb, segmentFilename, AVIO_FLAG_WRITE) < 0) {
+        avcodec_close(codecContext);
+        freeFormatContext(formatContext);
+        return NULL;
+    }
+    if (avformat_write_header(formatContext, NULL) < 0) {
+        avcodec_close(codecContext);
+        avio_close(formatContext->pb);
+        freeFormatContext(formatContext);
+        remove(segmentFilename);
+        return NULL;
+    }
+    
+    EncodeSegment* segment = new EncodeSegment;
+    segment->formatContext = formatContext;
+    segment->stream = stream;
+    segment->codecContext = codecContext;
+    segment->filename = segmentFilename;
+    if (!startSegment(segment)) {
+        avcodec_close(codecContext);
+        avio_close(formatContext->pb);
+        freeFormatContext(formatContext);
+        remove(segmentFilename);
+        delete segment;
+        return NULL;
+    }
+    return segment;
+}
+
+int WriteFFmpegPlugin::finishSegment(EncodeSegment* segment)
+{
+    if (segment->threadRunning) {
+        _queueCondition.lock();
+        segment->stop = true;
+        _queueCondition.broadcast();
+        _queueCondition.unlock();
+#if defined(_WIN32) || defined(WIN64)
+        WaitForSingleObject((HANDLE)segment->thread, INFINITE);
+        CloseHandle((HANDLE)segment->thread);
+        segment->thread = NULL;
+#else
+        pthread_join(segment->thread, NULL);
+#endif
+        segment->threadRunning = false;
+    }
+    if (segment->outputBuffer) {
+        av_freep(&segment->outputBuffer);
+        segment->outputBufferSize = 0;
+    }
+    // the output file is closed by endEncode
+    if (!segment->filename.empty()) {
+        av_write_trailer(segment->formatContext);
+        avcodec_close(segment->codecContext);
+        avio_close(segment->formatContext->pb);
+        freeFormatContext(segment->formatContext);
+        _segmentFiles.push_back(segment->filename);
+    }
+    delete segment;
+    
+    _queueCondition.lock();
+    int error = _encoderError;
+    _queueCondition.unlock();
+    return error;
+}
+
+int WriteFFmpegPlugin::finishSegments()
+{
+    int error = 0;
+    while (!_segments.empty()) {
+        error = finishSegment(_segments.front());
+        _segments.pop_front();
+    }
+    return error;
+}
+
+int WriteFFmpegPlugin::concatenateSegments()
+{
+    int64_t lastDts = AV_NOPTS_VALUE;
+    for (std::vector<std::string>::const_iterator it = _segmentFiles.begin(); it != _segmentFiles.end(); ++it) {
+        AVFormatContext* input = NULL;
+        int error = avformat_open_input(&input, it->c_str(), NULL, NULL);
+        if (error < 0) {
+            return error;
+        }
+        if (input->nb_streams < 1) {
+            avformat_close_input(&input);
+            return AVERROR_INVALIDDATA;
+        }
+        const AVRational inputTimeBase = input->streams[0]->time_base;
+        // The frames of all the segments have the pts of the sequence, only the time base changes. With B-frames, the
+        // first dts of a segment is before its first pts, and may overlap the end of the previous segment: the whole
+        // segment is then delayed, so that its pts and dts keep the same distances.
+        int64_t offset = 0;
+        bool offsetSet = false;
+        AVPacket pkt;
+        while ((error = av_read_frame(input, &pkt)) >= 0) {
+            if (pkt.dts != AV_NOPTS_VALUE) {
+                pkt.dts = av_rescale_q(pkt.dts, inputTimeBase, _stream->time_base);
+                if (!offsetSet) {
+                    if (lastDts != AV_NOPTS_VALUE && pkt.dts <= lastDts) {
+                        offset = lastDts + 1 - pkt.dts;
                     }
+                    offsetSet = true;
+                }
+                pkt.dts += offset;
+                lastDts = pkt.dts;
+            }
+            if (pkt.pts != AV_NOPTS_VALUE) {
+                pkt.pts = av_rescale_q(pkt.pts, inputTimeBase, _stream->time_base) + offset;
+            }
+            pkt.duration = (int)av_rescale_q(pkt.duration, inputTimeBase, _stream->time_base);
+            pkt.stream_index = _stream->index;
+            error = av_interleaved_write_frame(_formatContext, &pkt);
+            av_free_packet(&pkt);
+            if (error < 0) {
+                break;
+            }
+        }
+        avformat_close_input(&input);
+        if (error < 0 && error != AVERROR_EOF) {
+            return error;
+        }
+    }
+    return 0;
+}
+
+void WriteFFmpegPlugin::removeSegmentFiles()
+{
+    for (std::vector<std::string>::const_iterator it = _segmentFiles.begin(); it != _segmentFiles.end(); ++it) {
+        remove(it->c_str());
+    }
+    _segmentFiles.clear();
+}
+
+#if defined(_WIN32) || defined(WIN64)
+unsigned __stdcall WriteFFmpegPlugin::encoderThreadMain(void* segment)
+{
+    static_cast<EncodeSegment*>(segment)->plugin->encodeQueuedFrames(static_cast<EncodeSegment*>(segment));
+    return 0;
+}
+#else
+void* WriteFFmpegPlugin::encoderThreadMain(void* segment)
+{
+    static_cast<EncodeSegment*>(segment)->plugin->encodeQueuedFrames(static_cast<EncodeSegment*>(segment));
+    return NULL;
+}
+#endif
+
+void WriteFFmpegPlugin::encodeQueuedFrames(EncodeSegment* segment)
+{
+    int error = 0;
+    for (;;) {
+        _queueCondition.lock();
+        while (segment->queuedFrames.empty() && !segment->stop) {
+            _queueCondition.wait();
+        }
+        if (segment->queuedFrames.empty()) {
+            _queueCondition.unlock();
+            break;
+        }
+        AVFrame* frame = segment->queuedFrames.front();
+        segment->queuedFrames.pop_front();
+        _queueCondition.unlock();
+        
+        // after an error, the frames are only recycled until endEncode
+        if (error >= 0) {
+            error = encodeFrame(segment, frame);
+        }
+        
+        _queueCondition.lock();
+        if (error < 0 && _encoderError == 0) {
+            _encoderError = error;
+        }
+        _freeFrames.push_back(frame);
+        _queueCondition.broadcast();
+        _queueCondition.unlock();
+    }
+    if (error >= 0) {
+        error = flushEncoder(segment);
+        if (error < 0) {
+            _queueCondition.lock();
+            if (_encoderError == 0) {
+                _encoderError = error;
+            }
+            _queueCondition.unlock();
+        }
+    }
+}
+
+int WriteFFmpegPlugin::encodeFrame(EncodeSegment* segment, AVFrame* output)
+{
+    AVFormatContext* formatContext = segment->formatContext;
+    AVStream* stream = segment->stream;
+    AVCodecContext* codecContext = segment->codecContext;
+    int error = 0;
+    if ((formatContext->oformat->flags & AVFMT_RAWPICTURE) != 0) {
+        AVPacket pkt;
+        av_init_packet(&pkt);
+        pkt.flags |= AV_PKT_FLAG_KEY;
+        pkt.stream_index = stream->index;
+        pkt.data = (uint8_t*)output;
+        pkt.size = sizeof(AVPicture);
+        error = av_interleaved_write_frame(formatContext, &pkt);
+    }
+    else {
+#if LIBAVCODEC_VERSION_INT<AV_VERSION_INT(54,1,0)
+        uint8_t* outbuf = segment->outputBuffer;
+        assert(outbuf != NULL);
+        error = avcodec_encode_video(codecContext, outbuf, segment->outputBufferSize, output);
+        if (error <= 0) {
+            // error, or the frame was delayed by the encoder
+            return error;
+        }
+        
+        AVPacket pkt;
+        av_init_packet(&pkt);
+        if (codecContext->coded_frame && codecContext->coded_frame->pts != (int64_t)AV_NOPTS_VALUE)
+            pkt.pts = av_rescale_q(codecContext->coded_frame->pts, codecContext->time_base, stream->time_base);
+        if (codecContext->coded_frame && codecContext->coded_frame->key_frame)
+            pkt.flags |= AV_PKT_FLAG_KEY;
+        
+        pkt.stream_index = stream->index;
+        pkt.data = outbuf;
+        pkt.size = error;
+        
+        error = av_interleaved_write_frame(formatContext, &pkt);
+#else
+        AVPacket pkt;
+        int got_packet;
+        av_init_packet(&pkt);
+        pkt.size = 0;
+        pkt.data = NULL;
+        error = avcodec_encode_video2(codecContext, &pkt, output, &got_packet);
+        if (error < 0) {
+            return error;
+        }
+        
+        if (got_packet) {
+            if (pkt.pts != AV_NOPTS_VALUE) {
+                pkt.pts = av_rescale_q(pkt.pts, codecContext->time_base, stream->time_base);
+            }
+            if (pkt.dts != AV_NOPTS_VALUE) {
+                pkt.dts = av_rescale_q(pkt.dts, codecContext->time_base, stream->time_base);
+            }
+            pkt.stream_index = stream->index;
+
+            error = av_interleaved_write_frame(formatContext, &pkt);
+            av_free_packet(&pkt);
+        }
+#endif
+    }
+    return error;
+}
+
+int WriteFFmpegPlugin::flushEncoder(EncodeSegment* segment)
+{
+    AVFormatContext* formatContext = segment->formatContext;
+    AVStream* stream = segment->stream;
+    AVCodecContext* codecContext = segment->codecContext;
+    // frame threading and B-frames delay the output: get the remaining packets by encoding NULL frames
+    if (!codecContext || !codecContext->codec || !(codecContext->codec->capabilities & CODEC_CAP_DELAY) ||
+        (formatContext->oformat->flags & AVFMT_RAWPICTURE) != 0) {
+        return 0;
+    }
+    for (;;) {
+        AVPacket pkt;
+        av_init_packet(&pkt);
+#if LIBAVCODEC_VERSION_INT<AV_VERSION_INT(54,1,0)
+        int size = avcodec_encode_video(codecContext, segment->outputBuffer, segment->outputBufferSize, NULL);
+        if (size <= 0) {
+            break;
+        }
+        if (codecContext->coded_frame && codecContext->coded_frame->pts != (int64_t)AV_NOPTS_VALUE)
+            pkt.pts = av_rescale_q(codecContext->coded_frame->pts, codecContext->time_base, stream->time_base);
+        if (codecContext->coded_frame && codecContext->coded_frame->key_frame)
+            pkt.flags |= AV_PKT_FLAG_KEY;
+        pkt.stream_index = stream->index;
+        pkt.data = segment->outputBuffer;
+        pkt.size = size;
+        int error = av_interleaved_write_frame(formatContext, &pkt);
+        if (error < 0) {
+            return error;
+        }
+#else
+        pkt.size = 0;
+        pkt.data = NULL;
+        int got_packet = 0;
+        int error = avcodec_encode_video2(codecContext, &pkt, NULL, &got_packet);
+        if (error < 0) {
+            return error;
+        }
+        if (!got_packet) {
+            break;
+        }
+        if (pkt.pts != AV_NOPTS_VALUE) {
+            pkt.pts = av_rescale_q(pkt.pts, codecContext->time_base, stream->time_base);
+        }
+        if (pkt.dts != AV_NOPTS_VALUE) {
+            pkt.dts = av_rescale_q(pkt.dts, codecContext->time_base, stream->time_base);
+        }
+        pkt.stream_index = stream->index;
+        error = av_interleaved_write_frame(formatContext, &pkt);
+        av_free_packet(&pkt);
+        if (error < 0) {
+            return error;
+        }
+#endif
+    }
+    return 0;
+}
+
+// the memory which may be used by the frames waiting for the encoders
+static size_t getEncodeMemory()
+{
+    static long memoryMB = -1;
+    if (memoryMB < 0) {
+        memoryMB = kEncodeMemoryDefault;
+        const char* value = std::getenv(kEncodeMemoryEnv);
+        if (value) {
+            long l = std::strtol(value, NULL, 10);
+            if (l > 0) {
+                memoryMB = l;
+            }
+        }
+    }
+    return (size_t)memoryMB * 1024 * 1024;
+}
+
+bool WriteFFmpegPlugin::allocateConversion(int maxFrames)
+{
+    freeConversion();
+    
+    const int w = _codecContext->width;
+    const int h = _codecContext->height;
+    const PixelFormat pixFMT = _codecContext->pix_fmt;
+    
+    // keep the precision for codecs with more than 8 bits per component (e.g. 10-bit 4:2:2)
+    const AVPixFmtDescriptor* pixFmtDesc = av_pix_fmt_desc_get(pixFMT);
+    _rgbPixelFormat = (pixFmtDesc && pixFmtDesc->comp[0].depth_minus1 >= 8) ? PIX_FMT_RGB48 : PIX_FMT_RGB24;
+    
+    if (avpicture_alloc(&_rgbPicture, _rgbPixelFormat, w, h) < 0) {
+        return false;
+    }
+    _rgbPictureAllocated = true;
+    
+    // keep at least two frames, so that conversion and encoding overlap
+    const size_t frameBytes = std::max(avpicture_get_size(pixFMT, w, h), 1);
+    const size_t budgetFrames = std::max(getEncodeMemory() / frameBytes, (size_t)2);
+    _maxFrames = (int)std::min((size_t)maxFrames, budgetFrames);
+    
+    _rowBuffer.resize((size_t)w * 4);
+    
+    return true;
+}
+
+AVFrame* WriteFFmpegPlugin::allocateFrame()
+{
+    AVFrame* frame = av_frame_alloc();
+    if (!frame) {
+        return NULL;
+    }
+    if (av_image_alloc(frame->data, frame->linesize, _codecContext->width, _codecContext->height, _codecContext->pix_fmt, 1) < 0) {
+        av_free(frame);
+        return NULL;
+    }
+    _frames.push_back(frame);
+    return frame;
+}
+
+void WriteFFmpegPlugin::freeConversion()
+{
+    if (_rgbPictureAllocated) {
+        avpicture_free(&_rgbPicture);
+        _rgbPictureAllocated = false;
+    }
+    assert(_segments.empty());
+    for (std::vector<AVFrame*>::iterator it = _frames.begin(); it != _frames.end(); ++it) {
+        av_freep(&(*it)->data[0]);
+        av_free(*it);
+    }
+    _frames.clear();
+    _maxFrames = 0;
+    _freeFrames.clear();
+    _rowBuffer.clear();
+}
+
+// Quantize n float components to integers in [0, numvals-1], like floatToInt<numvals>.
+template<int numvals>
+static void
+floatToIntRow(const float* src, int n, int* dst)
+{
+    int i = 0;
+#ifdef OFX_IO_FFMPEG_HAS_SSE2
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 scale = _mm_set1_ps((float)(numvals - 1));
+    const __m128 half = _mm_set1_ps(0.5f);
+    for (; i + 4 <= n; i += 4) {
+        // max(x, 0) returns 0 for NaN
+        __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i), zero), one);
+        v = _mm_add_ps(_mm_mul_ps(v, scale), half);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_cvttps_epi32(v));
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] = floatToInt<numvals>(src[i]);
+    }
+}
+
+// convert the image to packed RGB, flipping it vertically
+template<typename PIX, int numvals>
+static void
+floatToRGB(const float *pixelData, const OfxRectI& bounds, int numChannels, int rowBytes, int* rowBuffer, const AVPicture& picture)
+{
+    const int w = bounds.x2 - bounds.x1;
+    for (int y = bounds.y1; y < bounds.y2; ++y) {
+        int dstY = bounds.y2 - y - 1;
+        const float* src_pixels = (const float*)((const char*)pixelData + (y-bounds.y1)*rowBytes);
+        PIX* dst_pixels = (PIX*)(picture.data[0] + picture.linesize[0] * dstY);
+        
+        floatToIntRow<numvals>(src_pixels, w * numChannels, rowBuffer);
+        
+        for (int x = 0; x < w; ++x) {
+            const int* src = rowBuffer + x * numChannels;
+            dst_pixels[x * 3 + 0] = (PIX)src[0];
+            dst_pixels[x * 3 + 1] = (PIX)src[1];
+            dst_pixels[x * 3 + 2] = (PIX)src[2];
+        }
+    }
+}
 
 
 void WriteFFmpegPlugin::encode(const std::string& filename, OfxTime time, const float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int rowBytes)
@@ -562,106 +1565,92 @@ void WriteFFmpegPlugin::encode(const std::string& filename, OfxTime time, const
     }
     assert(numChannels);
 
-    snprintf(_formatContext->filename, sizeof(_formatContext->filename), "%s", filename.c_str());
-    
-
     int w = (bounds.x2 - bounds.x1);
     int h = (bounds.y2 - bounds.y1);
     
-    
-    AVPicture picture;
-    int error = avpicture_alloc(&picture, PIX_FMT_RGB24,w, h);
-    checkAvError();
-
-
-    for (int y = bounds.y1; y < bounds.y2; ++y) {
-        int srcY = bounds.y2 - y - 1;
-        const float* src_pixels = (float*)((char*)pixelData + (y-bounds.y1)*rowBytes);
-        unsigned char* dst_pixels = picture.data[0] + (bounds.x2 - bounds.x1) * srcY * 3;
-        
-        for (int x = bounds.x1; x < bounds.x2; ++x) {
-            int srcCol = x * numChannels;
-            int dstCol = x * 3;
-            dst_pixels[dstCol + 0] = floatToInt<256>(src_pixels[srcCol + 0]);
-            dst_pixels[dstCol + 1] = floatToInt<256>(src_pixels[srcCol + 1]);
-            dst_pixels[dstCol + 2] = floatToInt<256>(src_pixels[srcCol + 2]);
-        }
+    if (w != _codecContext->width || h != _codecContext->height || !_rgbPictureAllocated) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "FFmpeg: all frames must have the size of the first frame");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
     }
-
-    
-    // now allocate an image frame for the image in the output codec's format...
-    AVFrame* output = av_frame_alloc();
-    PixelFormat pixFMT = _codecContext->pix_fmt;
     
-    error = av_image_alloc(output->data, output->linesize, w, h, pixFMT, 1);
-    checkAvError();
-    
-    SwsContext* convertCtx = sws_getContext(w, h, PIX_FMT_RGB24,w, h,
-                                            pixFMT, SWS_BICUBIC, NULL, NULL, NULL);
+    // quantize to the RGB picture, then convert it to the codec's format
+    if (_rgbPixelFormat == PIX_FMT_RGB48) {
+        floatToRGB<unsigned short, 65536>(pixelData, bounds, numChannels, rowBytes, &_rowBuffer[0], _rgbPicture);
+    } else {
+        floatToRGB<unsigned char, 256>(pixelData, bounds, numChannels, rowBytes, &_rowBuffer[0], _rgbPicture);
+    }
     
-    int sliceHeight = sws_scale(convertCtx, picture.data, picture.linesize, 0, h, output->data, output->linesize);
-    assert(sliceHeight > 0);
+    // in segment mode, a new encoder starts at each segment boundary, once an encoder is free
+    if (_segmentLength > 0 && (_framesQueued % _segmentLength) == 0) {
+        if ((int)_segments.size() >= _parallelSegments) {
+            int error = finishSegment(_segments.front());
+            _segments.pop_front();
+            checkAvError();
+        }
+        EncodeSegment* segment = createSegment((int)(_framesQueued / _segmentLength));
+        if (!segment) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "FFmpeg: unable to create the segment file");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+        _segments.push_back(segment);
+    }
+    if (_segments.empty()) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "FFmpeg: the encoder is not running");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
     
-    if ((_formatContext->oformat->flags & AVFMT_RAWPICTURE) != 0) {
-        AVPacket pkt;
-        av_init_packet(&pkt);
-        pkt.flags |= AV_PKT_FLAG_KEY;
-        pkt.stream_index = _stream->index;
-        pkt.data = (uint8_t*)output;
-        pkt.size = sizeof(AVPicture);
-        error = av_interleaved_write_frame(_formatContext, &pkt);
+    // Get a free frame, or allocate a new one while the pool is below its maximum size, else wait for the encoders.
+    // The frames are only allocated by this thread. The encoder threads report their errors with the next frame.
+    _queueCondition.lock();
+    while (_freeFrames.empty() && (int)_frames.size() >= _maxFrames && _encoderError == 0) {
+        _queueCondition.wait();
     }
-    else {
-#if LIBAVCODEC_VERSION_INT<AV_VERSION_INT(54,1,0)
-        size_t picSize = avpicture_get_size(pixFMT,w, h);
-        uint8_t* outbuf = (uint8_t*)av_malloc(picSize);
-        assert(outbuf != NULL);
-        error = avcodec_encode_video(_codecContext, outbuf, picSize, output);
-        checkAvError();
-        
-        AVPacket pkt;
-        av_init_packet(&pkt);
-        if (_codecContext->coded_frame && _codecContext->coded_frame->pts != (int64_t)AV_NOPTS_VALUE)
-            pkt.pts = av_rescale_q(_codecContext->coded_frame->pts, _codecContext->time_base, _stream->time_base);
-        if (_codecContext->coded_frame && _codecContext->coded_frame->key_frame)
-            pkt.flags |= AV_PKT_FLAG_KEY;
-        
-        pkt.stream_index = _stream->index;
-        pkt.data = outbuf;
-        pkt.size = error;
-        
-        error = av_interleaved_write_frame(_formatContext, &pkt);
-        av_free(outbuf);
-#else
-        AVPacket pkt;
-        int got_packet;
-        av_init_packet(&pkt);
-        pkt.size = 0;
-        pkt.data = NULL;
-        pkt.stream_index = _stream->index;
-        error = avcodec_encode_video2(_codecContext, &pkt, output, &got_packet);
-        checkAvError();
-        
-        if (got_packet) {
-            if (pkt.pts != AV_NOPTS_VALUE) {
-                pkt.pts = av_rescale_q(pkt.pts, _codecContext->time_base, _stream->time_base);
+    int error = _encoderError;
+    AVFrame* output = NULL;
+    if (error == 0 && !_freeFrames.empty()) {
+        output = _freeFrames.front();
+        _freeFrames.pop_front();
+    }
+    _queueCondition.unlock();
+    checkAvError();
+    if (!output) {
+        output = allocateFrame();
+        if (!output) {
+            if (_frames.empty()) {
+                setPersistentMessage(OFX::Message::eMessageError, "", "Out of memory");
+                OFX::throwSuiteStatusException(kOfxStatFailed);
             }
-            if (pkt.dts != AV_NOPTS_VALUE) {
-                pkt.dts = av_rescale_q(pkt.dts, _codecContext->time_base, _stream->time_base);
+            // use the frames allocated so far
+            _maxFrames = (int)_frames.size();
+            _queueCondition.lock();
+            while (_freeFrames.empty() && _encoderError == 0) {
+                _queueCondition.wait();
             }
-
-            error = av_interleaved_write_frame(_formatContext, &pkt);
-            av_free_packet(&pkt);
+            error = _encoderError;
+            if (error == 0) {
+                output = _freeFrames.front();
+                _freeFrames.pop_front();
+            }
+            _queueCondition.unlock();
             checkAvError();
         }
-#endif
     }
     
-    avpicture_free(&picture);
-    av_freep(&output->data[0]);
-    av_free(output);
+    bool converted = _converter.convert(_rgbPicture.data, _rgbPicture.linesize, w, _rgbPixelFormat,
+                                        output->data, output->linesize, w, _codecContext->pix_fmt, h, SWS_BICUBIC);
+    if (!converted) {
+        _queueCondition.lock();
+        _freeFrames.push_back(output);
+        _queueCondition.unlock();
+        setPersistentMessage(OFX::Message::eMessageError, "", "FFmpeg: unable to convert the frame to the codec pixel format");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    output->pts = _framesQueued++;
     
-    checkAvError();
+    _queueCondition.lock();
+    _segments.back()->queuedFrames.push_back(output);
+    _queueCondition.broadcast();
+    _queueCondition.unlock();
     
     _lastTimeEncoded = time;
     
@@ -674,10 +1663,7 @@ WriteFFmpegPlugin::setOutputFrameRate(double fps)
 }
 
 void WriteFFmpegPlugin::freeFormat() { 
-    for (int i = 0; i < static_cast<int>(_formatContext->nb_streams); ++i){
-        av_freep(&_formatContext->streams[i]);
-    }
-    av_free(_formatContext);
+    freeFormatContext(_formatContext);
     _formatContext = NULL;
     _stream = NULL;
 }
@@ -865,6 +1851,104 @@ void WriteFFmpegPluginFactory::describeInContext(OFX::ImageEffectDescriptor &des
             param->setAnimates(false);
             page->addChild(*param);
         }
+
+        ////////////Threading
+        {
+            OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamThreadType);
+            param->setLabels(kParamThreadTypeLabel, kParamThreadTypeLabel, kParamThreadTypeLabel);
+            param->setHint(kParamThreadTypeHint);
+            param->appendOption(kParamThreadTypeOptionFrameSlice);
+            param->appendOption(kParamThreadTypeOptionFrame);
+            param->appendOption(kParamThreadTypeOptionSlice);
+            param->appendOption(kParamThreadTypeOptionNone);
+            param->setDefault(eThreadTypeFrameSlice);
+            param->setParent(*group);
+            param->setAnimates(false);
+            page->addChild(*param);
+        }
+
+        ////////////Preset
+        {
+            OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamPreset);
+            param->setLabels(kParamPresetLabel, kParamPresetLabel, kParamPresetLabel);
+            param->setHint(kParamPresetHint);
+            param->appendOption("Default");
+            for (unsigned int i = 0; i < ARRAY_SIZE(kPresets); ++i) {
+                param->appendOption(kPresets[i]);
+            }
+            param->setDefault(0);
+            param->setParent(*group);
+            param->setAnimates(false);
+            page->addChild(*param);
+        }
+
+        ////////////CRF
+        {
+            OFX::IntParamDescriptor* param = desc.defineIntParam(kParamCRF);
+            param->setLabels(kParamCRFLabel, kParamCRFLabel, kParamCRFLabel);
+            param->setHint(kParamCRFHint);
+            param->setRange(-1, 63);
+            param->setDisplayRange(-1, 51);
+            param->setDefault(-1);
+            param->setParent(*group);
+            param->setAnimates(false);
+            page->addChild(*param);
+        }
+
+        ////////////Pixel format
+        {
+            OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamPixelFormat);
+            param->setLabels(kParamPixelFormatLabel, kParamPixelFormatLabel, kParamPixelFormatLabel);
+            param->setHint(kParamPixelFormatHint);
+            for (unsigned int i = 0; i < ARRAY_SIZE(kPixelFormatLabels); ++i) {
+                param->appendOption(kPixelFormatLabels[i]);
+            }
+            param->setDefault(0);
+            param->setParent(*group);
+            param->setAnimates(false);
+            page->addChild(*param);
+        }
+
+        ////////////Intra-only profile
+        {
+            OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamProfile);
+            param->setLabels(kParamProfileLabel, kParamProfileLabel, kParamProfileLabel);
+            param->setHint(kParamProfileHint);
+            param->appendOption("None");
+            for (unsigned int i = 0; i < ARRAY_SIZE(kIntraProfiles); ++i) {
+                param->appendOption(kIntraProfiles[i].label);
+            }
+            param->setDefault(0);
+            param->setParent(*group);
+            param->setAnimates(false);
+            page->addChild(*param);
+        }
+
+        ////////////Parallel segments
+        {
+            OFX::IntParamDescriptor* param = desc.defineIntParam(kParamParallelSegments);
+            param->setLabels(kParamParallelSegmentsLabel, kParamParallelSegmentsLabel, kParamParallelSegmentsLabel);
+            param->setHint(kParamParallelSegmentsHint);
+            param->setRange(1, 64);
+            param->setDisplayRange(1, 16);
+            param->setDefault(1);
+            param->setParent(*group);
+            param->setAnimates(false);
+            page->addChild(*param);
+        }
+
+        ////////////Segment length
+        {
+            OFX::IntParamDescriptor* param = desc.defineIntParam(kParamSegmentLength);
+            param->setLabels(kParamSegmentLengthLabel, kParamSegmentLengthLabel, kParamSegmentLengthLabel);
+            param->setHint(kParamSegmentLengthHint);
+            param->setRange(1, 100000);
+            param->setDisplayRange(1, 250);
+            param->setDefault(24);
+            param->setParent(*group);
+            param->setAnimates(false);
+            page->addChild(*param);
+        }
     }
     GenericWriterDescribeInContextEnd(desc, context, page);
 }
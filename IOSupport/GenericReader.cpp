@@ -1058,6 +1058,23 @@ GenericReaderPlugin::premultPixelData(const OfxRectI &renderWindow,
 }
 
 
+void
+GenericReaderPlugin::decodeMipmapLevel(const std::string& filename,
+                                       OfxTime time,
+                                       unsigned int level,
+                                       const OfxRectI& renderWindow,
+                                       float *pixelData,
+                                       const OfxRectI& bounds,
+                                       OFX::PixelComponentEnum pixelComponents,
+                                       int rowBytes)
+{
+    assert(level == 0);
+    if (level != 0) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    decode(filename, time, renderWindow, pixelData, bounds, pixelComponents, rowBytes);
+}
+
 bool
 GenericReaderPlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args,
                                            OfxRectD &rod)
@@ -1290,6 +1307,17 @@ GenericReaderPlugin::render(const OFX::RenderArguments &args)
         OFX::throwSuiteStatusException(kOfxStatFailed);
     }
 
+    // If the file contains lower resolution images, decode from the closest one
+    unsigned int fileMipmapLevel = 0;
+    if (downscaleLevels > 0) {
+        fileMipmapLevel = getFileMipmapLevel(filename, sequenceTime, (unsigned int)downscaleLevels);
+        assert((int)fileMipmapLevel <= downscaleLevels);
+        if (fileMipmapLevel > 0) {
+            frameBounds = downscalePowerOfTwoSmallestEnclosing(frameBounds, fileMipmapLevel);
+            downscaleLevels -= fileMipmapLevel;
+        }
+    }
+
     renderWindowFullRes = upscalePowerOfTwo(args.renderWindow, downscaleLevels); // works even if downscaleLevels == 0
 
     // Intersect the full res renderwindow to the real rod,
@@ -1322,10 +1350,10 @@ GenericReaderPlugin::render(const OFX::RenderArguments &args)
                         ((premult == OFX::eImagePreMultiplied && !_ocio->isIdentity(args.time)) ||
                          premult == OFX::eImageUnPreMultiplied));
 
-    if (!mustPremult && _ocio->isIdentity(args.time) && (!kSupportsRenderScale || renderMipmapLevel == 0)) {
-        // no colorspace conversion, no premultiplication, no proxy, just read file
+    if (!mustPremult && _ocio->isIdentity(args.time) && (!kSupportsRenderScale || renderMipmapLevel == fileMipmapLevel)) {
+        // no colorspace conversion, no premultiplication, no proxy, no scaling, just read file
         DBG(std::printf("decode (to dst)\n"));
-        decode(filename, sequenceTime, args.renderWindow, dstPixelDataF, bounds, pixelComponents, dstRowBytes);
+        decodeMipmapLevel(filename, sequenceTime, fileMipmapLevel, args.renderWindow, dstPixelDataF, bounds, pixelComponents, dstRowBytes);
 
     } else {
         int pixelBytes = getPixelBytes(pixelComponents, bitDepth);
@@ -1336,7 +1364,7 @@ GenericReaderPlugin::render(const OFX::RenderArguments &args)
 
         // read file
         DBG(std::printf("decode (to tmp)\n"));
-        decode(filename, sequenceTime, renderWindowFullRes, tmpPixelData, renderWindowFullRes, pixelComponents, tmpRowBytes);
+        decodeMipmapLevel(filename, sequenceTime, fileMipmapLevel, renderWindowFullRes, tmpPixelData, renderWindowFullRes, pixelComponents, tmpRowBytes);
 
         ///do the color-space conversion
         if (!_ocio->isIdentity(args.time) && pixelComponents != OFX::ePixelComponentAlpha) {
@@ -1425,18 +1453,7 @@ GenericReaderPlugin::inputFileChanged()
         ///all the sequence
         _fileParam->getValueAtTime(tmp.min, filename);
         ///let the derive class a chance to initialize any data structure it may need
-        
-        OFX::PixelComponentEnum components;
-        OFX::PreMultiplicationEnum premult;
-        onInputFileChanged(filename, &premult, &components);
-        // RGB is always Opaque, Alpha is always PreMultiplied
-        if (components == OFX::ePixelComponentRGB) {
-            premult = OFX::eImageOpaque;
-        } else if (components == OFX::ePixelComponentAlpha) {
-            premult = OFX::eImagePreMultiplied;
-        }
-        setOutputComponents(components);
-        _premult->setValue((int)premult);
+        setComponentsFromFile(filename);
         
         bool customFps;
         _customFPS->getValue(customFps);
@@ -1450,6 +1467,32 @@ GenericReaderPlugin::inputFileChanged()
     }
 }
 
+void
+GenericReaderPlugin::setComponentsFromFile(const std::string& filename)
+{
+    OFX::PixelComponentEnum components;
+    OFX::PreMultiplicationEnum premult;
+    onInputFileChanged(filename, &premult, &components);
+    // RGB is always Opaque, Alpha is always PreMultiplied
+    if (components == OFX::ePixelComponentRGB) {
+        premult = OFX::eImageOpaque;
+    } else if (components == OFX::ePixelComponentAlpha) {
+        premult = OFX::eImagePreMultiplied;
+    }
+    setOutputComponents(components);
+    _premult->setValue((int)premult);
+}
+
+void
+GenericReaderPlugin::updateComponentsFromFile()
+{
+    std::string filename;
+    if (getFilenameAtTime(getStartingTime(), &filename) != kOfxStatOK) {
+        return;
+    }
+    setComponentsFromFile(filename);
+}
+
 void
 GenericReaderPlugin::changedParam(const OFX::InstanceChangedArgs &args,
                                   const std::string &paramName)
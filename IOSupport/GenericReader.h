@@ -135,12 +135,23 @@ protected:
     
     OFX::PixelComponentEnum getOutputComponents() const;
     
+    /**
+     * @brief Update the output components and premultiplication from the first image of the sequence, as when the input
+     * file changes. Call this when a param of the reader changes what is read from the file (e.g. the layer).
+     **/
+    void updateComponentsFromFile();
+    
 
 
 private:
     
     
     void setOutputComponents(OFX::PixelComponentEnum comps);
+    
+    /**
+     * @brief Set the output components and premultiplication from onInputFileChanged.
+     **/
+    void setComponentsFromFile(const std::string& filename);
 
     /**
      * @brief Called when the input image/video file changed.
@@ -188,6 +199,23 @@ private:
      **/
     virtual void decode(const std::string& filename, OfxTime time, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int rowBytes) = 0;
     
+    /**
+     * @brief Override if the file may contain the image at lower resolutions (mipmap levels),
+     * each level being downscaled by a power of 2. When rendering at a render scale lower than 1,
+     * the image is then decoded from the closest level instead of being decoded at full
+     * resolution and downscaled.
+     * Returns the highest level stored in the file which is lower or equal to the given level.
+     **/
+    virtual unsigned int getFileMipmapLevel(const std::string& /*filename*/, OfxTime /*time*/, unsigned int /*level*/) { return 0; }
+    
+    /**
+     * @brief Decode the image at a mipmap level returned by getFileMipmapLevel().
+     * renderWindow and bounds are in pixel coordinates at that level, i.e. the full resolution
+     * bounds downscaled by 2^level.
+     * The default implementation only supports level 0, and calls decode().
+     **/
+    virtual void decodeMipmapLevel(const std::string& filename, OfxTime time, unsigned int level, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int rowBytes);
+    
     
     /**
      * @brief Override to indicate the time domain. Return false if you know that the
@@ -149,6 +149,10 @@ private:
 
     virtual void decode(const std::string& filename, OfxTime time, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int rowBytes) OVERRIDE FINAL;
 
+    virtual unsigned int getFileMipmapLevel(const std::string& filename, OfxTime time, unsigned int level) OVERRIDE FINAL;
+
+    virtual void decodeMipmapLevel(const std::string& filename, OfxTime time, unsigned int level, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int rowBytes) OVERRIDE FINAL;
+
     virtual bool getFrameBounds(const std::string& filename, OfxTime time, OfxRectI *bounds, double *par, std::string *error) OVERRIDE FINAL;
 
     virtual void onOutputComponentsParamChanged(OFX::PixelComponentEnum components) OVERRIDE FINAL;
@@ -926,12 +930,82 @@ ReadOIIOPlugin::onInputFileChanged(const std::string &filename,
 #endif
 }
 
+// The bounds of the data window of the image in the full/display window, in OpenFX pixel coordinates (y is flipped)
+static OfxRectI
+dataWindowBounds(const ImageSpec& spec)
+{
+    OfxRectI bounds;
+    bounds.x1 = (spec.x - spec.full_x);
+    bounds.x2 = (spec.x + spec.width - spec.full_x);
+    bounds.y1 = spec.full_y + spec.full_height - (spec.y + spec.height);
+    bounds.y2 = (spec.full_height) + (spec.full_y - spec.y);
+    return bounds;
+}
+
+// The bounds of a mipmap level of the file, in OpenFX pixel coordinates at that level. Returns false if the level is not
+// exactly the full resolution data window downscaled by 2^level as given by downscalePowerOfTwoSmallestEnclosing: the
+// file levels are downscaled from the top-left corner of the data window, which must be on the grid of the level, and
+// levels rounded down (e.g. by maketx) are missing the last row or column.
+static bool
+mipmapLevelBounds(const ImageSpec& fullResSpec,
+                  const ImageSpec& spec,
+                  unsigned int level,
+                  OfxRectI* levelBounds)
+{
+    const OfxRectI fullResBounds = dataWindowBounds(fullResSpec);
+    const int pot_minus1 = (1 << level) - 1;
+    *levelBounds = downscalePowerOfTwoSmallestEnclosing(fullResBounds, level);
+    return ((fullResBounds.x1 & pot_minus1) == 0 &&
+            (fullResBounds.y2 & pot_minus1) == 0 &&
+            spec.width == levelBounds->x2 - levelBounds->x1 &&
+            spec.height == levelBounds->y2 - levelBounds->y1 &&
+            spec.nchannels == fullResSpec.nchannels);
+}
+
+unsigned int
+ReadOIIOPlugin::getFileMipmapLevel(const std::string& filename,
+                                   OfxTime /*time*/,
+                                   unsigned int level)
+{
+#if defined(OFX_READ_OIIO_USES_CACHE) && defined(OFX_READ_OIIO_NEWMENU)
+    // The highest level stored in the file (e.g. tiled TIFF or EXR textures, .tx files) which is not above the
+    // requested level, and which really is the full resolution image downscaled by 2^level. GenericReader downscales
+    // that level to the requested one.
+    ImageSpec fullResSpec;
+    if (level == 0 || !_cache->get_imagespec(ustring(filename), fullResSpec)) {
+        return 0;
+    }
+    unsigned int fileLevel = 0;
+    for (unsigned int l = 1; l <= level; ++l) {
+        ImageSpec spec;
+        if (!_cache->get_imagespec(ustring(filename), spec, 0, (int)l)) {
+            // clear the error of the missing level
+            _cache->geterror();
+            break;
+        }
+        OfxRectI levelBounds;
+        if (!mipmapLevelBounds(fullResSpec, spec, l, &levelBounds)) {
+            break;
+        }
+        fileLevel = l;
+    }
+    return fileLevel;
+#else
+    return 0;
+#endif
+}
+
 void ReadOIIOPlugin::decode(const std::string& filename, OfxTime time, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int rowBytes)
+{
+    decodeMipmapLevel(filename, time, 0, renderWindow, pixelData, bounds, pixelComponents, rowBytes);
+}
+
+void ReadOIIOPlugin::decodeMipmapLevel(const std::string& filename, OfxTime time, unsigned int level, const OfxRectI& renderWindow, float *pixelData, const OfxRectI& bounds, OFX::PixelComponentEnum pixelComponents, int rowBytes)
 {
 #ifdef OFX_READ_OIIO_USES_CACHE
     ImageSpec spec;
     //use the thread-safe version of get_imagespec (i.e: make a copy of the imagespec)
-    if(!_cache->get_imagespec(ustring(filename), spec)){
+    if(!_cache->get_imagespec(ustring(filename), spec, 0, (int)level)){
         setPersistentMessage(OFX::Message::eMessageError, "", _cache->geterror());
         OFX::throwSuiteStatusException(kOfxStatFailed);
     }
@@ -963,6 +1037,28 @@ void ReadOIIOPlugin::decode(const std::string& filename, OfxTime time, const Ofx
     assert(bounds.y1 <= renderWindow.y1 && renderWindow.y1 <= renderWindow.y2 && renderWindow.y2 <= bounds.y2);
 
 #ifdef OFX_READ_OIIO_NEWMENU
+#ifdef OFX_READ_OIIO_USES_CACHE
+    // the file column of the OpenFX column x is x + fileXOffset, the file row of the OpenFX row y is fileYFlip - 1 - y
+    int fileXOffset = spec.full_x;
+    int fileYFlip = spec.full_y + spec.full_height;
+    if (level > 0) {
+        ImageSpec fullResSpec;
+        if (!_cache->get_imagespec(ustring(filename), fullResSpec)) {
+            setPersistentMessage(OFX::Message::eMessageError, "", _cache->geterror());
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+        // getFileMipmapLevel only returns the levels which cover the bounds exactly
+        OfxRectI levelBounds;
+        if (!mipmapLevelBounds(fullResSpec, spec, level, &levelBounds)) {
+            setPersistentMessage(OFX::Message::eMessageError, "", "OIIO: the mipmap level does not match the image");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
+        fileXOffset = spec.x - levelBounds.x1;
+        fileYFlip = spec.y + levelBounds.y2;
+    }
+#else
+    assert(level == 0);
+#endif
     int rChannel, gChannel, bChannel, aChannel;
     _rChannel->getValueAtTime(time, rChannel);
     _gChannel->getValueAtTime(time, gChannel);
@@ -1036,11 +1132,11 @@ void ReadOIIOPlugin::decode(const std::string& filename, OfxTime time, const Ofx
 #ifdef OFX_READ_OIIO_USES_CACHE
             if (!_cache->get_pixels(ustring(filename),
                                     0, //subimage
-                                    0, //miplevel
-                                    spec.full_x + renderWindow.x1, //x begin
-                                    spec.full_x + renderWindow.x2, //x end
-                                    spec.full_y + spec.full_height - renderWindow.y2, //y begin
-                                    spec.full_y + spec.full_height - renderWindow.y1, //y end
+                                    (int)level, //miplevel
+                                    fileXOffset + renderWindow.x1, //x begin
+                                    fileXOffset + renderWindow.x2, //x end
+                                    fileYFlip - renderWindow.y2, //y begin
+                                    fileYFlip - renderWindow.y1, //y end
                                     0, //z begin
                                     1, //z end
                                     chbegin, //chan begin
@@ -1309,10 +1405,7 @@ ReadOIIOPlugin::getFrameBounds(const std::string& filename,
 #endif
     // the image coordinates are expressed in the "full/display" image.
     // The RoD are the coordinates of the data window with respect to that full window
-    bounds->x1 = (spec.x - spec.full_x);
-    bounds->x2 = (spec.x + spec.width - spec.full_x);
-    bounds->y1 = spec.full_y + spec.full_height - (spec.y + spec.height);
-    bounds->y2 = (spec.full_height) + (spec.full_y - spec.y);
+    *bounds = dataWindowBounds(spec);
     *par = spec.get_float_attribute("PixelAspectRatio", 1);
 #ifdef OFX_READ_OIIO_USES_CACHE
 #else